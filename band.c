@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "band.h"
+#include "util.h"
+
+// Rows are split into at most one contiguous band per thread, and
+// never into bands shorter than this.  Which thread runs a band can't
+// change what it computes, so the output matches a serial run.
+#define MIN_BAND_ROWS 16
+#define MAX_BAND_THREADS 32
+
+static struct
+{
+  int threads;			// Counting the caller; 0 for one per CPU.
+  int workers;
+  pthread_t *worker;
+  pthread_mutex_t lock;
+  pthread_cond_t wake, done;
+  unsigned int generation;
+  int quit;
+
+  band_fn fn;
+  void *arg;
+  int rows, bands, next, unfinished;
+} pool = {
+  .threads = 1,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+  .done = PTHREAD_COND_INITIALIZER,
+};
+
+
+// Hand out bands of the current job until there are none left.  Called
+// with the lock held.
+static void run_bands(void)
+{
+  while (pool.next < pool.bands)
+    {
+      int band = pool.next++;
+      band_fn fn = pool.fn;
+      void *arg = pool.arg;
+      int first = (long long) pool.rows * band / pool.bands;
+      int end = (long long) pool.rows * (band + 1) / pool.bands;
+
+      pthread_mutex_unlock(&pool.lock);
+      fn(arg, first, end);
+      pthread_mutex_lock(&pool.lock);
+
+      if (--pool.unfinished == 0)
+	pthread_cond_signal(&pool.done);
+    }
+}
+
+
+static void *band_worker(void *unused)
+{
+  unsigned int generation;
+
+  pthread_mutex_lock(&pool.lock);
+  generation = pool.generation;
+  for (;;)
+    {
+      while (!pool.quit && generation == pool.generation)
+	pthread_cond_wait(&pool.wake, &pool.lock);
+      if (pool.quit)
+	break;
+      generation = pool.generation;
+      run_bands();
+    }
+  pthread_mutex_unlock(&pool.lock);
+  return NULL;
+}
+
+
+// THREADS is the image-threads resource: a count, or 0 for auto.
+void band_set_threads(int threads)
+{
+  if (threads == 0)
+    {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = cpus > 0 ? cpus : 1;
+    }
+  if (threads > MAX_BAND_THREADS)
+    threads = MAX_BAND_THREADS;
+
+  band_shutdown();
+  pool.threads = threads;
+}
+
+
+// Workers are started by the first job that can use them, so a greeter
+// which hits the pixel cache never creates any.
+static void start_workers(void)
+{
+  pool.worker = xmalloc((pool.threads - 1) * sizeof(pthread_t));
+  while (pool.workers < pool.threads - 1)
+    {
+      if (pthread_create(&pool.worker[pool.workers], NULL,
+			 band_worker, NULL))
+	break;
+      pool.workers++;
+    }
+}
+
+
+void band_run(int rows, band_fn fn, void *arg)
+{
+  int bands = rows / MIN_BAND_ROWS;
+
+  if (bands > pool.threads)
+    bands = pool.threads;
+  if (bands > 1 && !pool.worker)
+    start_workers();
+  if (bands > pool.workers + 1)
+    bands = pool.workers + 1;
+  if (bands <= 1)
+    {
+      fn(arg, 0, rows);
+      return;
+    }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.fn = fn;
+  pool.arg = arg;
+  pool.rows = rows;
+  pool.bands = bands;
+  pool.next = 0;
+  pool.unfinished = bands;
+  pool.generation++;
+  pthread_cond_broadcast(&pool.wake);
+
+  run_bands();
+  while (pool.unfinished)
+    pthread_cond_wait(&pool.done, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+
+// Stop the workers.  The greeter calls this once the images are
+// uploaded so nothing is left running when it forks a session.
+void band_shutdown(void)
+{
+  if (!pool.worker)
+    return;
+
+  pthread_mutex_lock(&pool.lock);
+  pool.quit = 1;
+  pthread_cond_broadcast(&pool.wake);
+  pthread_mutex_unlock(&pool.lock);
+
+  for (int i = 0; i < pool.workers; i++)
+    pthread_join(pool.worker[i], NULL);
+
+  free(pool.worker);
+  pool.worker = NULL;
+  pool.workers = 0;
+  pool.quit = 0;
+}
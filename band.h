@@ -0,0 +1,12 @@
+#ifndef _BAND_H_
+#define _BAND_H_
+
+// Work on rows FIRST up to but not including END.  Bands of one job
+// run concurrently, so a band function may only write its own rows.
+typedef void (*band_fn)(void *arg, int first, int end);
+
+void band_set_threads(int threads);
+void band_run(int rows, band_fn fn, void *arg);
+void band_shutdown(void);
+
+#endif /* _BAND_H_ */
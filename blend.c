@@ -0,0 +1,281 @@
+#include <stdlib.h>
+#include "blend.h"
+#include "simd.h"
+
+// Alpha blending of byte channels.  blend_bytes takes ALPHA per byte
+// rather than per pixel, so it serves any pixel layout; blend_pixels
+// takes it from the spare byte of 32-bit pixels.  DST is the
+// foreground and takes the result:
+//
+//   straight:       dst = (dst * a + src * (255 - a)) / 255
+//   premultiplied:  dst = dst + src * (255 - a) / 255
+//
+// Divisions are rounded to nearest, so an opaque pixel keeps its value
+// and a clear one takes the background's.  All of x / 255 for x up to
+// 255 * 255 is (x + 128 + ((x + 128) >> 8)) >> 8, which also fits in
+// 16-bit lanes.
+
+typedef void (*blend_fn)(unsigned char *dst, const unsigned char *alpha,
+			 const unsigned char *src, int n, int premultiplied);
+typedef void (*blend_pixels_fn)(unsigned char *dst, const unsigned char *src,
+				int n, int alpha_at, int premultiplied);
+
+static inline unsigned int div255(unsigned int x)
+{
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+static inline unsigned char blend_byte(unsigned int d, unsigned int a,
+				       unsigned int s, int premultiplied)
+{
+  if (premultiplied)
+    {
+      unsigned int sum = d + div255(s * (255 - a));
+      return sum > 255 ? 255 : sum;
+    }
+  return div255(d * a + s * (255 - a));
+}
+
+static void blend_scalar(unsigned char *dst, const unsigned char *alpha,
+			 const unsigned char *src, int n, int premultiplied)
+{
+  for (int i = 0; i < n; i++)
+    dst[i] = blend_byte(dst[i], alpha[i], src[i], premultiplied);
+}
+
+// The same for four-byte pixels carrying their alpha in byte ALPHA_AT,
+// which comes out opaque.
+static void blend_pixels_scalar(unsigned char *dst, const unsigned char *src,
+				int n, int alpha_at, int premultiplied)
+{
+  for (int i = 0; i < n; i++, dst += 4, src += 4)
+    {
+      unsigned int a = dst[alpha_at];
+
+      for (int k = 0; k < 4; k++)
+	dst[k] = blend_byte(dst[k], a, src[k], premultiplied);
+      dst[alpha_at] = 255;
+    }
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+#define DEFINE_DIV255(NAME, TARGET, VEC, ADD, SRLI, SET1)	\
+  TARGET static inline VEC NAME(VEC x)				\
+  {								\
+    x = ADD(x, SET1(128));					\
+    return SRLI(ADD(x, SRLI(x, 8)), 8);				\
+  }
+
+DEFINE_DIV255(div255_sse2, TARGET_SSE2, __m128i,
+	      _mm_add_epi16, _mm_srli_epi16, _mm_set1_epi16)
+DEFINE_DIV255(div255_avx2, TARGET_AVX2, __m256i,
+	      _mm256_add_epi16, _mm256_srli_epi16, _mm256_set1_epi16)
+
+// One half of a vector in 16-bit lanes.
+#define DEFINE_BLEND_HALF(NAME, TARGET, VEC, SUB, ADD, MULLO, SET1, DIV)	\
+  TARGET static inline VEC NAME(VEC d, VEC a, VEC s, int premultiplied)	\
+  {									\
+    VEC inverse = SUB(SET1(255), a);					\
+									\
+    if (premultiplied)							\
+      return ADD(d, DIV(MULLO(s, inverse)));				\
+    return DIV(ADD(MULLO(d, a), MULLO(s, inverse)));			\
+  }
+
+DEFINE_BLEND_HALF(blend_half_sse2, TARGET_SSE2, __m128i, _mm_sub_epi16,
+		  _mm_add_epi16, _mm_mullo_epi16, _mm_set1_epi16,
+		  div255_sse2)
+DEFINE_BLEND_HALF(blend_half_avx2, TARGET_AVX2, __m256i, _mm256_sub_epi16,
+		  _mm256_add_epi16, _mm256_mullo_epi16, _mm256_set1_epi16,
+		  div255_avx2)
+
+TARGET_SSE2
+static void blend_sse2(unsigned char *dst, const unsigned char *alpha,
+		       const unsigned char *src, int n, int premultiplied)
+{
+  const __m128i zero = _mm_setzero_si128();
+  int i;
+
+  for (i = 0; i + 16 <= n; i += 16)
+    {
+      __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+      __m128i a = _mm_loadu_si128((const __m128i *) (alpha + i));
+      __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+      __m128i low =
+	blend_half_sse2(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(a, zero),
+			_mm_unpacklo_epi8(s, zero), premultiplied);
+      __m128i high =
+	blend_half_sse2(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(a, zero),
+			_mm_unpackhi_epi8(s, zero), premultiplied);
+
+      // Saturates the premultiplied sum as the scalar code does.
+      _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(low, high));
+    }
+
+  blend_scalar(dst + i, alpha + i, src + i, n - i, premultiplied);
+}
+
+// Each pixel's alpha, in 16-bit lanes, copied over the pixel's lanes.
+TARGET_SSE2
+static inline __m128i spread_alpha_sse2(__m128i x, int alpha_at)
+{
+  if (alpha_at)
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xff), 0xff);
+  return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0), 0);
+}
+
+TARGET_SSE2
+static void blend_pixels_sse2(unsigned char *dst, const unsigned char *src,
+			      int n, int alpha_at, int premultiplied)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i opaque = _mm_set1_epi32((int) (0xffu << 8 * alpha_at));
+  int i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      __m128i d = _mm_loadu_si128((const __m128i *) (dst + 4 * i));
+      __m128i s = _mm_loadu_si128((const __m128i *) (src + 4 * i));
+      __m128i d_low = _mm_unpacklo_epi8(d, zero);
+      __m128i d_high = _mm_unpackhi_epi8(d, zero);
+      __m128i low =
+	blend_half_sse2(d_low, spread_alpha_sse2(d_low, alpha_at),
+			_mm_unpacklo_epi8(s, zero), premultiplied);
+      __m128i high =
+	blend_half_sse2(d_high, spread_alpha_sse2(d_high, alpha_at),
+			_mm_unpackhi_epi8(s, zero), premultiplied);
+
+      _mm_storeu_si128((__m128i *) (dst + 4 * i),
+		       _mm_or_si128(_mm_packus_epi16(low, high), opaque));
+    }
+
+  blend_pixels_scalar(dst + 4 * i, src + 4 * i, n - i, alpha_at,
+		      premultiplied);
+}
+
+TARGET_AVX2
+static void blend_avx2(unsigned char *dst, const unsigned char *alpha,
+		       const unsigned char *src, int n, int premultiplied)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  int i;
+
+  for (i = 0; i + 32 <= n; i += 32)
+    {
+      __m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+      __m256i a = _mm256_loadu_si256((const __m256i *) (alpha + i));
+      __m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+      __m256i low =
+	blend_half_avx2(_mm256_unpacklo_epi8(d, zero),
+			_mm256_unpacklo_epi8(a, zero),
+			_mm256_unpacklo_epi8(s, zero), premultiplied);
+      __m256i high =
+	blend_half_avx2(_mm256_unpackhi_epi8(d, zero),
+			_mm256_unpackhi_epi8(a, zero),
+			_mm256_unpackhi_epi8(s, zero), premultiplied);
+
+      // Unpacking and packing both work within 128-bit lanes, so the
+      // bytes come back in order.
+      _mm256_storeu_si256((__m256i *) (dst + i),
+			  _mm256_packus_epi16(low, high));
+    }
+
+  blend_sse2(dst + i, alpha + i, src + i, n - i, premultiplied);
+}
+
+TARGET_AVX2
+static inline __m256i spread_alpha_avx2(__m256i x, int alpha_at)
+{
+  if (alpha_at)
+    return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(x, 0xff), 0xff);
+  return _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(x, 0), 0);
+}
+
+TARGET_AVX2
+static void blend_pixels_avx2(unsigned char *dst, const unsigned char *src,
+			      int n, int alpha_at, int premultiplied)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i opaque = _mm256_set1_epi32((int) (0xffu << 8 * alpha_at));
+  int i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      __m256i d = _mm256_loadu_si256((const __m256i *) (dst + 4 * i));
+      __m256i s = _mm256_loadu_si256((const __m256i *) (src + 4 * i));
+      __m256i d_low = _mm256_unpacklo_epi8(d, zero);
+      __m256i d_high = _mm256_unpackhi_epi8(d, zero);
+      __m256i low =
+	blend_half_avx2(d_low, spread_alpha_avx2(d_low, alpha_at),
+			_mm256_unpacklo_epi8(s, zero), premultiplied);
+      __m256i high =
+	blend_half_avx2(d_high, spread_alpha_avx2(d_high, alpha_at),
+			_mm256_unpackhi_epi8(s, zero), premultiplied);
+
+      _mm256_storeu_si256((__m256i *) (dst + 4 * i),
+			  _mm256_or_si256(_mm256_packus_epi16(low, high),
+					  opaque));
+    }
+
+  blend_pixels_sse2(dst + 4 * i, src + 4 * i, n - i, alpha_at,
+		    premultiplied);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+static blend_fn blend_kernel(void)
+{
+  static blend_fn kernel;
+
+  if (!kernel)
+    {
+      kernel = blend_scalar;
+#ifdef HAVE_X86_SIMD
+      if (CPU_HAS("avx2"))
+	kernel = blend_avx2;
+      else if (CPU_HAS("sse2"))
+	kernel = blend_sse2;
+#endif
+    }
+  return kernel;
+}
+
+
+static blend_pixels_fn blend_pixels_kernel(void)
+{
+  static blend_pixels_fn kernel;
+
+  if (!kernel)
+    {
+      kernel = blend_pixels_scalar;
+#ifdef HAVE_X86_SIMD
+      if (CPU_HAS("avx2"))
+	kernel = blend_pixels_avx2;
+      else if (CPU_HAS("sse2"))
+	kernel = blend_pixels_sse2;
+#endif
+    }
+  return kernel;
+}
+
+
+// Blend N bytes of SRC under DST.
+void blend_bytes(unsigned char *dst, const unsigned char *alpha,
+		 const unsigned char *src, int n, int premultiplied)
+{
+  blend_kernel()(dst, alpha, src, n, premultiplied);
+}
+
+
+// Blend N pixels of SRC under DST, which has its alpha in byte ALPHA_AT
+// of each 32-bit pixel, 0 or 3, and the rest where SRC has its
+// channels.  The alpha byte of the result is 255.
+void blend_pixels(unsigned char *dst, const unsigned char *src, int n,
+		  int alpha_at, int premultiplied)
+{
+  blend_pixels_kernel()(dst, src, n, alpha_at, premultiplied);
+}
@@ -0,0 +1,9 @@
+#ifndef _BLEND_H_
+#define _BLEND_H_
+
+void blend_bytes(unsigned char *dst, const unsigned char *alpha,
+		 const unsigned char *src, int n, int premultiplied);
+void blend_pixels(unsigned char *dst, const unsigned char *src, int n,
+		  int alpha_at, int premultiplied);
+
+#endif /* _BLEND_H_ */
@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include "cache.h"
+#include "upload.h"
+#include "util.h"
+
+// A cache file is a header, the key it was built from, then the
+// ZPixmap data exactly as it went to XPutImage.  Bump the version when
+// anything upstream of imageToPixmap changes what the pixels look like.
+
+#define CACHE_MAGIC "gleemPX"
+#define CACHE_VERSION 8
+#define CACHE_DATA_ALIGN 64
+
+struct cache_header
+{
+  char magic[8];
+  unsigned int version, key_length, data_offset;
+  int width, height, depth, bits_per_pixel, bytes_per_line, byte_order;
+};
+
+
+void cache_key_init(struct cache_key *key)
+{
+  key->size = 256;
+  key->str = xmalloc(key->size);
+  key->str[0] = '\0';
+  key->len = 0;
+}
+
+
+void cache_key_free(struct cache_key *key)
+{
+  free(key->str);
+  key->str = NULL;
+}
+
+
+void cache_key_add(struct cache_key *key, const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  for (;;)
+    {
+      va_start(ap, fmt);
+      n = vsnprintf(key->str + key->len, key->size - key->len, fmt, ap);
+      va_end(ap);
+      // Keep one byte spare for the field separator.
+      if (n >= 0 && key->len + n + 1 < key->size)
+	break;
+      key->size = 2 * key->size + (n > 0 ? n : 0);
+      key->str = xrealloc(key->str, key->size);
+    }
+  key->len += n;
+  key->str[key->len++] = '\n';
+  key->str[key->len] = '\0';
+}
+
+
+// Identify a source file by name, size and modification time.
+int cache_key_add_file(struct cache_key *key, const char *filename)
+{
+  struct stat st;
+
+  if (stat(filename, &st))
+    return 0;
+  cache_key_add(key, "file=%s:%lld:%lld", filename,
+		(long long) st.st_size, (long long) st.st_mtime);
+  return 1;
+}
+
+
+// Identify the pixel format imageToPixmap will produce.  Colormapped
+// visuals aren't cacheable since the pixels depend on the colormap.
+int cache_key_add_visual(struct cache_key *key, Display *dpy, int scr)
+{
+  XVisualInfo v_template, *visual_info;
+  XPixmapFormatValues *formats;
+  int entries, bpp = 0, depth = DefaultDepth(dpy, scr);
+
+  v_template.visualid = XVisualIDFromVisual(DefaultVisual(dpy, scr));
+  if (!(visual_info = XGetVisualInfo(dpy, VisualIDMask, &v_template,
+				     &entries)))
+    return 0;
+  if (visual_info->class != TrueColor)
+    {
+      XFree(visual_info);
+      return 0;
+    }
+
+  if ((formats = XListPixmapFormats(dpy, &entries)))
+    {
+      for (int i = 0; i < entries; i++)
+	if (formats[i].depth == depth)
+	  bpp = formats[i].bits_per_pixel;
+      XFree(formats);
+    }
+
+  cache_key_add(key, "visual=%d:%d:%d:%lx:%lx:%lx", depth, bpp,
+		ImageByteOrder(dpy), visual_info->red_mask,
+		visual_info->green_mask, visual_info->blue_mask);
+  XFree(visual_info);
+  return 1;
+}
+
+
+static unsigned long long fnv1a(const char *str)
+{
+  unsigned long long hash = 14695981039346656037ULL;
+
+  while (*str)
+    {
+      hash ^= (unsigned char) *str++;
+      hash *= 1099511628211ULL;
+    }
+  return hash;
+}
+
+
+// The file name depends only on IDENT, so a changed theme overwrites
+// its old entry rather than leaving it behind.  Returns 1 and fills in
+// ENTRY if a file matching KEY exists.  On a miss ENTRY still records
+// where to store the pixels once they have been computed.
+int cache_lookup(const char *dir, const char *ident, struct cache_key *key,
+		 struct cache_entry *entry)
+{
+  char name[24];
+  struct stat st;
+  struct cache_header *header;
+  int fd;
+
+  cache_release(entry);
+  snprintf(name, sizeof(name), "%016llx", fnv1a(ident));
+  entry->path = mkfilepath(2, dir, name);
+  entry->key = xstrdup(key->str);
+
+  if ((fd = open(entry->path, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st) || st.st_size < sizeof(struct cache_header))
+    {
+      close(fd);
+      return 0;
+    }
+  entry->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (entry->map == MAP_FAILED)
+    {
+      entry->map = NULL;
+      return 0;
+    }
+  entry->map_size = st.st_size;
+
+  header = entry->map;
+  if (memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC))
+      || header->version != CACHE_VERSION
+      || header->key_length != key->len
+      || header->data_offset < sizeof(*header) + header->key_length
+      || header->width <= 0 || header->height <= 0
+      || header->bits_per_pixel <= 0 || header->bytes_per_line <= 0
+      || (size_t) header->width * header->bits_per_pixel
+      > 8 * (size_t) header->bytes_per_line
+      || header->data_offset
+      + (size_t) header->height * header->bytes_per_line > st.st_size
+      || memcmp((char *) (header + 1), key->str, key->len))
+    {
+      cache_unmap(entry);
+      return 0;
+    }
+
+  entry->width = header->width;
+  entry->height = header->height;
+  entry->depth = header->depth;
+  entry->bits_per_pixel = header->bits_per_pixel;
+  entry->bytes_per_line = header->bytes_per_line;
+  entry->byte_order = header->byte_order;
+  entry->data = (char *) entry->map + header->data_offset;
+  return 1;
+}
+
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+  const char *ptr = buf;
+
+  while (len)
+    {
+      ssize_t n = write(fd, ptr, len);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return 0;
+	}
+      ptr += n;
+      len -= n;
+    }
+  return 1;
+}
+
+
+// Failure to store is never fatal; the next start just misses again.
+// A store can also be fed in strips: STRIP has the width and format of
+// the whole image but only some of its rows, and HEIGHT is the total.
+void cache_store_begin(struct cache_entry *entry, XImage *strip, int height)
+{
+  static const char padding[CACHE_DATA_ALIGN];
+  struct cache_header header;
+  char *slash;
+
+  if (!entry->path)
+    return;
+
+  if ((slash = strrchr(entry->path, '/')))
+    {
+      *slash = '\0';
+      mkdir(entry->path, 0755);
+      *slash = '/';
+    }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  header.version = CACHE_VERSION;
+  header.key_length = strlen(entry->key);
+  header.data_offset = sizeof(header) + header.key_length;
+  header.data_offset += CACHE_DATA_ALIGN - 1;
+  header.data_offset &= ~(CACHE_DATA_ALIGN - 1);
+  header.width = strip->width;
+  header.height = height;
+  header.depth = strip->depth;
+  header.bits_per_pixel = strip->bits_per_pixel;
+  header.bytes_per_line = strip->bytes_per_line;
+  header.byte_order = strip->byte_order;
+
+  entry->tmp_path = xmalloc(strlen(entry->path) + 16);
+  sprintf(entry->tmp_path, "%s.%d", entry->path, (int) getpid());
+  if ((entry->fd = open(entry->tmp_path, O_WRONLY | O_CREAT | O_TRUNC,
+			0644)) < 0)
+    {
+      free(entry->tmp_path);
+      entry->tmp_path = NULL;
+      return;
+    }
+
+  entry->store_ok = write_all(entry->fd, &header, sizeof(header))
+    && write_all(entry->fd, entry->key, header.key_length)
+    && write_all(entry->fd, padding,
+		 header.data_offset - sizeof(header) - header.key_length);
+}
+
+
+void cache_store_rows(struct cache_entry *entry, XImage *strip, int rows)
+{
+  if (entry->tmp_path && entry->store_ok)
+    entry->store_ok = write_all(entry->fd, strip->data,
+				(size_t) rows * strip->bytes_per_line);
+}
+
+
+void cache_store_end(struct cache_entry *entry)
+{
+  int ok;
+
+  if (!entry->tmp_path)
+    return;
+
+  ok = !close(entry->fd) && entry->store_ok;
+
+  // Rename so concurrent greeters never map a partial file.
+  if (!ok || rename(entry->tmp_path, entry->path))
+    unlink(entry->tmp_path);
+  free(entry->tmp_path);
+  entry->tmp_path = NULL;
+}
+
+
+void cache_store(struct cache_entry *entry, XImage *ximage)
+{
+  cache_store_begin(entry, ximage, ximage->height);
+  cache_store_rows(entry, ximage, ximage->height);
+  cache_store_end(entry);
+}
+
+
+// Drop a hit but remember where to store a fresh copy.
+void cache_unmap(struct cache_entry *entry)
+{
+  if (entry->map)
+    munmap(entry->map, entry->map_size);
+  entry->map = NULL;
+  entry->data = NULL;
+}
+
+
+// Also drops a store that was begun but never ended, say when reading
+// failed part way, with its temporary file.
+void cache_release(struct cache_entry *entry)
+{
+  if (entry->tmp_path)
+    {
+      close(entry->fd);
+      unlink(entry->tmp_path);
+      free(entry->tmp_path);
+    }
+  cache_unmap(entry);
+  free(entry->path);
+  free(entry->key);
+  memset(entry, 0, sizeof(*entry));
+}
+
+
+Pixmap cacheToPixmap(Display *dpy, struct cache_entry *entry, int scr,
+		     Window win)
+{
+  const int depth = DefaultDepth(dpy, scr);
+  Pixmap pixmap = XCreatePixmap(dpy, win, entry->width, entry->height,
+				depth);
+  struct upload up;
+  int shm;
+
+  if (entry->depth != depth)
+    {
+      fprintf(stderr, "Cached image doesn't match the display\n");
+      return pixmap;
+    }
+
+  // The mapping is already in memory, but a copy into shared memory
+  // still beats pushing it down the connection.
+  if (!(shm = upload_create_shm(&up, dpy, scr, entry->width, entry->height)))
+    upload_wrap(&up, XCreateImage(dpy, DefaultVisual(dpy, scr), depth,
+				  ZPixmap, 0, entry->data,
+				  entry->width, entry->height,
+				  8, entry->bytes_per_line));
+
+  // Nothing is read from the mapping until its rows are known to be
+  // as long as the display will take them to be.
+  if (up.ximage->bits_per_pixel == entry->bits_per_pixel
+      && up.ximage->byte_order == entry->byte_order)
+    {
+      GC gc = XCreateGC(dpy, win, 0, NULL);
+
+      if (shm)
+	{
+	  int line = entry->bytes_per_line < up.ximage->bytes_per_line
+	    ? entry->bytes_per_line : up.ximage->bytes_per_line;
+
+	  for (int j = 0; j < entry->height; j++)
+	    memcpy(up.ximage->data + j * up.ximage->bytes_per_line,
+		   entry->data + j * entry->bytes_per_line, line);
+	}
+      upload_put(&up, dpy, pixmap, gc, 0, entry->height);
+      XFreeGC(dpy, gc);
+    }
+  else
+    fprintf(stderr, "Cached image doesn't match the display\n");
+
+  upload_destroy(&up, dpy);
+  return pixmap;
+}
@@ -0,0 +1,40 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+// Everything that went into producing a cached pixmap, flattened into
+// one string so a cache file can be checked against it byte for byte.
+struct cache_key
+{
+  char *str;
+  int len, size;
+};
+
+struct cache_entry
+{
+  char *path, *key;
+  void *map;
+  size_t map_size;
+  int width, height, depth, bits_per_pixel, bytes_per_line, byte_order;
+  char *data;		// Points into map on a hit, NULL otherwise.
+  char *tmp_path;	// Set while a store is under way.
+  int fd, store_ok;
+};
+
+void cache_key_init(struct cache_key *key);
+void cache_key_free(struct cache_key *key);
+void cache_key_add(struct cache_key *key, const char *fmt, ...);
+int cache_key_add_file(struct cache_key *key, const char *filename);
+int cache_key_add_visual(struct cache_key *key, Display *dpy, int scr);
+
+int cache_lookup(const char *dir, const char *ident, struct cache_key *key,
+		 struct cache_entry *entry);
+void cache_store(struct cache_entry *entry, XImage *ximage);
+void cache_store_begin(struct cache_entry *entry, XImage *strip, int height);
+void cache_store_rows(struct cache_entry *entry, XImage *strip, int rows);
+void cache_store_end(struct cache_entry *entry);
+void cache_unmap(struct cache_entry *entry);
+void cache_release(struct cache_entry *entry);
+Pixmap cacheToPixmap(Display *dpy, struct cache_entry *entry, int scr,
+		     Window win);
+
+#endif /* _CACHE_H_ */
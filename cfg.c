@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <unistd.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -21,9 +22,15 @@
 #endif
 
 #include "util.h"
+#include "band.h"
 #include "keywords.h"
+#include "cache.h"
 #include "image.h"
+#include "resample.h"
 #include "cfg.h"
+#include "read.h"
+#include "render.h"
+#include "rotate.h"
 
 #if __STDC_VERSION__ >= 199901L
 #define INLINE_DECL inline
@@ -105,6 +112,41 @@ static int get_cfg_count(Display *dpy, void *valptr, char *num_str)
   return GET_CFG_FAIL;
 }
 
+// A thread count, with 0 standing for one per CPU.
+static int get_cfg_threads(Display *dpy, void *valptr, char *num_str)
+{
+  if (lookup_keyword(num_str, strlen(num_str)) == KEYWORD_AUTO)
+    {
+      *(int *)valptr = 0;
+      return ALLOC_STATIC;
+    }
+  if (get_cfg_count(dpy, valptr, num_str) == ALLOC_STATIC
+      && *(int *)valptr > 0)
+    return ALLOC_STATIC;
+
+  LogError("Invalid thread count %s\n", num_str);
+  return GET_CFG_FAIL;
+}
+
+// Degrees clockwise, kept as the ORIENT_ value for that turn.
+static int get_cfg_rotation(Display *dpy, void *valptr, char *num_str)
+{
+  static const int turns[] = {
+    ORIENT_NORMAL, ORIENT_ROTATE_90, ORIENT_ROTATE_180, ORIENT_ROTATE_270
+  };
+  int degrees;
+
+  if (get_cfg_count(dpy, &degrees, num_str) == ALLOC_STATIC
+      && degrees % 90 == 0 && degrees < 360)
+    {
+      *(int *)valptr = turns[degrees / 90];
+      return ALLOC_STATIC;
+    }
+
+  LogError("Invalid rotation %s\n", num_str);
+  return GET_CFG_FAIL;
+}
+
 static int get_cfg_xinerama(Display *dpy, void *valptr, char *screen_name)
 {
   XineramaScreenInfo *screen_info;
@@ -291,12 +333,25 @@ static void free_cfg_string(Display *dpy, void *ptr)
 
 static int get_cfg_bkgnd_style(Display *dpy, void *valptr, char *style_name)
 {
-  switch ((*(int *)valptr = lookup_keyword(style_name, strlen(style_name))))
+  switch (lookup_keyword(style_name, strlen(style_name)))
     {
     case KEYWORD_TILE:
+      *(int *)valptr = STYLE_TILE;
+      break;
     case KEYWORD_CENTER:
+      *(int *)valptr = STYLE_CENTER;
+      break;
     case KEYWORD_STRETCH:
+      *(int *)valptr = STYLE_STRETCH;
+      break;
+    case KEYWORD_FILL:
+      *(int *)valptr = STYLE_FILL;
+      break;
+    case KEYWORD_FIT:
+      *(int *)valptr = STYLE_FIT;
+      break;
     case KEYWORD_COLOR:
+      *(int *)valptr = STYLE_COLOR;
       break;
     default:
       LogError("Invalid background style %s\n", style_name);
@@ -306,6 +361,31 @@ static int get_cfg_bkgnd_style(Display *dpy, void *valptr, char *style_name)
   return ALLOC_STATIC;
 }
 
+static int get_cfg_bkgnd_filter(Display *dpy, void *valptr,
+				char *filter_name)
+{
+  switch (lookup_keyword(filter_name, strlen(filter_name)))
+    {
+    case KEYWORD_NEAREST:
+      *(int *)valptr = FILTER_NEAREST;
+      break;
+    case KEYWORD_BILINEAR:
+      *(int *)valptr = FILTER_BILINEAR;
+      break;
+    case KEYWORD_BOX:
+      *(int *)valptr = FILTER_BOX;
+      break;
+    case KEYWORD_LANCZOS3:
+      *(int *)valptr = FILTER_LANCZOS3;
+      break;
+    default:
+      LogError("Invalid background filter %s\n", filter_name);
+      return GET_CFG_FAIL;
+    }
+
+  return ALLOC_STATIC;
+}
+
 #define SCAN_COORD(COORD, DIMEN, FLAG)					\
   scan = strtol(str, &end, 10);						\
   if (str == end)							\
@@ -479,6 +559,14 @@ static ResourceSpec cfg_resources[] = {
   DECLSTATIC(XINERAMA_SCREEN, get_cfg_xinerama,
 	     DEFAULT_XINERAMA_SCREEN, screen_specs),
   DECLSTRING(EXTENSION_PROGRAM, DEFAULT_EXTENSION_PROGRAM, extension_program),
+  DECLSTRING(CACHE_DIRECTORY, DEFAULT_CACHE_DIRECTORY, cache_directory),
+  DECLSTATIC(IMAGE_THREADS, get_cfg_threads, DEFAULT_IMAGE_THREADS,
+	     image_threads),
+  DECLBOOLEAN(STREAM_BACKGROUND, STREAM_BACKGROUND, stream_background),
+  DECLSTATIC(ROTATE_BACKGROUND, get_cfg_rotation, DEFAULT_ROTATE_BACKGROUND,
+	     background_rotate),
+  DECLBOOLEAN(RENDER_SCALE, RENDER_SCALE, render_scale),
+  DECLBOOLEAN(DITHER, DITHER, dither),
   DECLSTRING(PASS_PROMPT, DEFAULT_PASS_PROMPT, password_prompt),
   DECLSTRING(USER_PROMPT, DEFAULT_USER_PROMPT, username_prompt),
   DECLSTRING(MSG_BAD_PASS, DEFAULT_MSG_BAD_PASS, msg_bad_pass),
@@ -550,6 +638,8 @@ static ResourceSpec theme_resources[] = {
   DECLCOUNT(INPUT_HEIGHT, INPUT_HEIGHT, input_height),
   DECLSTATIC(BACKGROUND_STYLE, get_cfg_bkgnd_style, DEFAULT_BKGND_STYLE,
 	     background_style),
+  DECLSTATIC(BACKGROUND_FILTER, get_cfg_bkgnd_filter, DEFAULT_BKGND_FILTER,
+	     background_filter),
 };
 
 #define NUM_THEME (sizeof(theme_resources) / sizeof(ResourceSpec))
@@ -597,8 +687,233 @@ static void free_theme_resources(Display *dpy, Cfg *cfg)
 
   free_image_buffers(&cfg->panel_image);
   free_image_buffers(&cfg->background_image);
+  close_image_rows(cfg->background_rows);
+  cfg->background_rows = NULL;
+  cache_release(&cfg->panel_cache);
+  cache_release(&cfg->background_cache);
+}
+
+
+// Look for the final background and panel pixels from an earlier start.
+// All that are looked for have to hit, since the background is merged
+// into the panel.  Solid and tiled backgrounds and the plain panel are
+// drawn by the server, and leave nothing to cache.
+static int get_cached_images(Display *dpy, Cfg *cfg, char *theme_path)
+{
+  struct cache_key key;
+  char *filepath, *ident;
+  int usable, hits = 0, wanted = 0;
+
+  // The scaled background never comes back to be stored.
+  if (!theme_path || !cfg->cache_directory || !*cfg->cache_directory
+      || cfg->render_scale)
+    return 0;
+
+  cache_key_init(&key);
+  usable = cache_key_add_visual(&key, dpy, DefaultScreen(dpy));
+  if (usable && cfg->background_filename)
+    {
+      filepath = mkfilepath(2, theme_path, cfg->background_filename);
+      usable = cache_key_add_file(&key, filepath);
+      free(filepath);
+    }
+  if (usable && cfg->panel_filename)
+    {
+      filepath = mkfilepath(2, theme_path, cfg->panel_filename);
+      usable = cache_key_add_file(&key, filepath);
+      free(filepath);
+    }
+  cache_key_add(&key, "dither=%d", cfg->dither);
+  cache_key_add(&key, "filter=%d", cfg->background_filter);
+  cache_key_add(&key, "style=%d", cfg->background_style);
+  cache_key_add(&key, "rotate=%d", cfg->background_rotate);
+  // The server blends the panel if it can, and rounds its own way.
+  cache_key_add(&key, "render=%d", render_usable(dpy, DefaultScreen(dpy)));
+  cache_key_add(&key, "screen=%ux%u",
+		cfg->screen_specs.width, cfg->screen_specs.height);
+  cache_key_add(&key, "panel=%d:%d:%d",
+		TO_XY(cfg->panel_position), cfg->panel_position.flags);
+  cache_key_add(&key, "colors=%04x%04x%04x:%04x%04x%04x",
+		cfg->background_color.color.red,
+		cfg->background_color.color.green,
+		cfg->background_color.color.blue,
+		cfg->panel_color.color.red,
+		cfg->panel_color.color.green,
+		cfg->panel_color.color.blue);
+
+  if (usable)
+    {
+      ident = xmalloc(strlen(theme_path) + 64);
+      if (cfg->background_style != STYLE_COLOR
+	  && cfg->background_style != STYLE_TILE)
+	{
+	  sprintf(ident, "%s:%ux%u:background", theme_path,
+		  cfg->screen_specs.width, cfg->screen_specs.height);
+	  hits += cache_lookup(cfg->cache_directory, ident, &key,
+			       &cfg->background_cache);
+	  wanted++;
+	}
+      if (cfg->panel_filename)
+	{
+	  sprintf(ident, "%s:%ux%u:panel", theme_path,
+		  cfg->screen_specs.width, cfg->screen_specs.height);
+	  hits += cache_lookup(cfg->cache_directory, ident, &key,
+			       &cfg->panel_cache);
+	  wanted++;
+	}
+      free(ident);
+    }
+  cache_key_free(&key);
+
+  if (wanted && hits == wanted)
+    {
+      cfg->background_image.width = cfg->background_cache.width;
+      cfg->background_image.height = cfg->background_cache.height;
+      cfg->panel_image.width = cfg->panel_cache.width;
+      cfg->panel_image.height = cfg->panel_cache.height;
+      return 1;
+    }
+
+  cache_unmap(&cfg->background_cache);
+  cache_unmap(&cfg->panel_cache);
+  return 0;
+}
+
+
+
+// Backgrounds made for particular screen sizes, named by resources
+// such as background.file.1920x1080.
+struct background_variants
+{
+  int depth;			// Of the quarks naming a variant.
+  unsigned int screen_width, screen_height;
+  unsigned int fit_width, fit_height, big_width, big_height;
+  char *exact, *fit, *biggest;
+};
+
+static Bool add_background_variant(XrmDatabase *db, XrmBindingList bindings,
+				   XrmQuarkList quarks,
+				   XrmRepresentation *type, XrmValue *value,
+				   XPointer closure)
+{
+  struct background_variants *variants =
+    (struct background_variants *) closure;
+  unsigned int width, height;
+  int count, end = 0;
+
+  for (count = 0; quarks[count] != NULLQUARK; count++)
+    ;
+  if (count != variants->depth
+      || sscanf(XrmQuarkToString(quarks[count - 1]), "%ux%u%n",
+		&width, &height, &end) != 2
+      || XrmQuarkToString(quarks[count - 1])[end] || !width || !height)
+    return False;
+
+  if (width == variants->screen_width && height == variants->screen_height)
+    {
+      variants->exact = value->addr;
+      return True;
+    }
+  if (width >= variants->screen_width && height >= variants->screen_height
+      && (!variants->fit || (unsigned long) width * height
+	  < (unsigned long) variants->fit_width * variants->fit_height))
+    {
+      variants->fit = value->addr;
+      variants->fit_width = width;
+      variants->fit_height = height;
+    }
+  if (!variants->biggest || (unsigned long) width * height
+      > (unsigned long) variants->big_width * variants->big_height)
+    {
+      variants->biggest = value->addr;
+      variants->big_width = width;
+      variants->big_height = height;
+    }
+  return False;
 }
 
+// Prefer a background variant made for the screen, or else the
+// smallest one covering it, so as little as possible is decoded and
+// resampled.  Otherwise the plain background.file stands, and failing
+// that the biggest variant.
+static char *background_variant(XrmDatabase db, Cfg *cfg, char *plain)
+{
+  struct background_variants variants;
+  XrmQuark names[8], classes[8];
+  int i;
+
+  memset(&variants, 0, sizeof(variants));
+  variants.screen_width = cfg->screen_specs.width;
+  variants.screen_height = cfg->screen_specs.height;
+
+  XrmStringToQuarkList(THEME_RESOURCE_PREFIX
+		       STRINGIFY(RNAME_BACKGROUND_FILE), names);
+  for (i = 0; names[i] != NULLQUARK; i++)
+    classes[i] = XrmStringToQuark(DUMMY_RESOURCE_CLASS);
+  classes[i] = NULLQUARK;
+  variants.depth = i + 1;
+  XrmEnumerateDatabase(db, names, classes, XrmEnumOneLevel,
+		       add_background_variant, (XPointer) &variants);
+
+  if (variants.exact)
+    return variants.exact;
+  if (variants.fit)
+    return variants.fit;
+  return plain ? plain : variants.biggest;
+}
+
+static void choose_background_variant(XrmDatabase db, Cfg *cfg)
+{
+  char *choice = background_variant(db, cfg, cfg->background_filename);
+
+  if (!choice || choice == cfg->background_filename)
+    return;
+
+  if (cfg->background_filename_ALLOC)
+    free(cfg->background_filename);
+  cfg->background_filename = xstrdup(choice);
+  cfg->background_filename_ALLOC = 1;
+}
+
+
+// Start the kernel reading the theme's images as soon as the theme
+// file is open.  Fonts and colors are set up and the cache looked up
+// meanwhile, and a cache hit just wastes the read.
+static void prefetch_theme_images(XrmDatabase db, Cfg *cfg,
+				  char *theme_path)
+{
+  static const char *resources[2] = {
+    THEME_RESOURCE_PREFIX STRINGIFY(RNAME_BACKGROUND_FILE),
+    THEME_RESOURCE_PREFIX STRINGIFY(RNAME_PANEL_FILE)
+  };
+  char *type, *file, *filepath;
+  XrmValue value;
+
+  for (int i = 0; i < 2; i++)
+    {
+      file = XrmGetResource(db, resources[i], DUMMY_RESOURCE_CLASS,
+			    &type, &value) ? value.addr : NULL;
+      if (i == 0)
+	file = background_variant(db, cfg, file);
+      if (file)
+	{
+	  filepath = mkfilepath(2, theme_path, file);
+	  prefetch_file(filepath);
+	  free(filepath);
+	}
+    }
+}
+
+
+// How much of the background each STYLE_ needs decoded.
+static const int style_frame[] = {
+  [STYLE_COLOR] = FRAME_WHOLE,
+  [STYLE_TILE] = FRAME_WHOLE,
+  [STYLE_CENTER] = FRAME_CENTER,
+  [STYLE_STRETCH] = FRAME_WHOLE,
+  [STYLE_FILL] = FRAME_FILL,
+  [STYLE_FIT] = FRAME_FIT
+};
 
 
 static int get_theme(Display *dpy, Cfg *cfg, char *theme_path)
@@ -619,6 +934,7 @@ static int get_theme(Display *dpy, Cfg *cfg, char *theme_path)
 	  LogError("Can't read theme file!\n");
 	  goto bugout;
 	}
+      prefetch_theme_images(db, cfg, theme_path);
     }
   else
     // Use compiled-in defaults.
@@ -644,23 +960,59 @@ static int get_theme(Display *dpy, Cfg *cfg, char *theme_path)
 	  *(int *)((char *)cfg + spec->allocated) = 1;
 	}
     }
+  choose_background_variant(db, cfg);
+  if (!cfg->background_filename)
+    cfg->background_style = STYLE_COLOR;
+
+  const int layout = native_layout(dpy, DefaultScreen(dpy));
 
-  if (cfg->panel_filename)
+  if (!get_cached_images(dpy, cfg, theme_path))
     {
-      filepath = mkfilepath(2, theme_path, cfg->panel_filename);
-      if (!read_image(filepath, &cfg->panel_image))
+      if (cfg->panel_filename)
 	{
-	  LogError("Missing panel image: %s\n", filepath);
-	  goto bugout;
+	  // On a 32-bit server the panel's alpha goes in its pixels.
+	  filepath = mkfilepath(2, theme_path, cfg->panel_filename);
+	  if (!read_image(filepath, &cfg->panel_image, 0, 0,
+			  layout == LAYOUT_RGB ? LAYOUT_RGB
+			  : LAYOUT_WITH_ALPHA(layout),
+			  FRAME_WHOLE, ORIENT_NORMAL))
+	    {
+	      LogError("Missing panel image: %s\n", filepath);
+	      goto bugout;
+	    }
 	}
     }
 
-  if (cfg->background_filename)
+  // A tile is needed even when the panel is cached, and is read whole.
+  if (cfg->background_style == STYLE_TILE)
+    {
+      free(filepath);
+      filepath = mkfilepath(2, theme_path, cfg->background_filename);
+      if (!read_image(filepath, &cfg->background_image, 0, 0, layout,
+		      FRAME_WHOLE, cfg->background_rotate))
+	{
+	  LogError("Missing background image: %s\n", filepath);
+	  goto bugout;
+	}
+    }
+  else if (cfg->background_style != STYLE_COLOR
+	   && !cfg->background_cache.data)
     {
       free(filepath);
       filepath = mkfilepath(2, theme_path, cfg->background_filename);
 
-      if (!read_image(filepath, &cfg->background_image))
+      // Streaming only reads the header for now.  Other styles read
+      // only as much of the image as reaches the screen.  Rows can't
+      // stream through a turn.
+      if (cfg->stream_background && cfg->background_style == STYLE_STRETCH
+	  && cfg->background_rotate == ORIENT_NORMAL
+	  ? !(cfg->background_rows =
+	      open_image_rows(filepath, cfg->screen_specs.width,
+			      cfg->screen_specs.height, layout))
+	  : !read_image(filepath, &cfg->background_image,
+			cfg->screen_specs.width, cfg->screen_specs.height,
+			layout, style_frame[cfg->background_style],
+			cfg->background_rotate))
 	{
 	  LogError("Missing background image: %s\n", filepath);
 	  goto bugout;
@@ -712,6 +1064,10 @@ Cfg *get_cfg(Display *dpy)
 	  *(int *)((char *)&cfg + spec->allocated) = 1;
 	}
     }
+  // The theme's images are decoded, cropped and turned below, so the
+  // pool has to be the right size before any of that.
+  band_set_threads(cfg.image_threads);
+
   theme_dir =
     xstrdup(XrmGetResource(db,
 			   MAIN_RESOURCE_PREFIX
@@ -24,6 +24,12 @@
 #define RNAME_ALLOW_KBD_SLEEP allow-keyboard-sleep
 #define RNAME_ALLOW_KBD_HALT allow-keyboard-halt
 #define RNAME_BAD_PASS_DELAY bad-password-delay
+#define RNAME_CACHE_DIRECTORY cache-directory
+#define RNAME_IMAGE_THREADS image-threads
+#define RNAME_STREAM_BACKGROUND stream-background
+#define RNAME_ROTATE_BACKGROUND rotate-background
+#define RNAME_RENDER_SCALE render-scale
+#define RNAME_DITHER dither
 
 #define RNAME_MSG_BAD_PASS msg.bad-password
 #define RNAME_MSG_BAD_SHELL msg.bad-shell
@@ -98,7 +104,8 @@
 
 // -- Miscelaneous
 
-#define RNAME_BACKGROUND_STYLE background-style
+#define RNAME_BACKGROUND_STYLE background.style
+#define RNAME_BACKGROUND_FILTER background.filter
 #define RNAME_CURSOR_SIZE cursor.size
 #define RNAME_CURSOR_OFFSET cursor.offset
 #define RNAME_CLOCK_FORMAT clock.format
@@ -127,6 +134,12 @@
 #define DEFAULT_ALLOW_KBD_SLEEP "false"
 #define DEFAULT_ALLOW_KBD_HALT "false"
 #define DEFAULT_EXTENSION_PROGRAM NULL
+#define DEFAULT_CACHE_DIRECTORY "/var/cache/gleem"
+#define DEFAULT_IMAGE_THREADS "auto"
+#define DEFAULT_STREAM_BACKGROUND "false"
+#define DEFAULT_ROTATE_BACKGROUND "0"
+#define DEFAULT_RENDER_SCALE "false"
+#define DEFAULT_DITHER "false"
 
 #define DEFAULT_MSG_BAD_PASS "Invalid user or password"
 #define DEFAULT_MSG_BAD_SHELL "Invalid login shell"
@@ -142,7 +155,8 @@
 #define DEFAULT_PASS_MASK " "
 
 #define DEFAULT_CURSOR_COLOR "gray50"
-#define DEFAULT_BKGND_STYLE "color"
+#define DEFAULT_BKGND_STYLE "stretch"
+#define DEFAULT_BKGND_FILTER "bilinear"
 #define DEFAULT_BKGND_COLOR "black"
 #define DEFAULT_PANEL_COLOR "gray30"
 #define DEFAULT_MESSAGE_COLOR "red"
@@ -193,6 +207,15 @@
 #define THEME_FILE_NAME "theme.defn"
 
 #define MAX_THEMES 64
+
+// How the background fills the screen.  Color is all there is without
+// a background file.
+#define STYLE_COLOR 0
+#define STYLE_TILE 1
+#define STYLE_CENTER 2
+#define STYLE_STRETCH 3
+#define STYLE_FILL 4		// Cropped to the screen's shape.
+#define STYLE_FIT 5		// Letterboxed in the background color.
 struct _ScreenSpecs {
   unsigned int xoffset;
   unsigned int yoffset;
@@ -214,12 +237,17 @@ typedef struct _XYPosition XYPosition;
 
 struct _Cfg {
   struct image background_image, panel_image;
+  struct cache_entry background_cache, panel_cache;
+  struct row_source *background_rows;	// Instead of background_image.
   int auto_login, focus_password;
   int allow_root, allow_null_pass, allow_kbd_sleep, allow_kbd_halt;
   int cursor_blink, input_highlight;
   int message_duration, bad_pass_delay;
+  int image_threads, stream_background, render_scale, dither;
+  int background_rotate;	// ORIENT_ value.
   ScreenSpecs screen_specs;
-  int background_style;
+  int background_style;		// STYLE_ value.
+  int background_filter;	// FILTER_ value from resample.h.
   char password_mask;
   XYPosition panel_position;
   XYPosition message_position, welcome_position, clock_position;
@@ -254,6 +282,7 @@ struct _Cfg {
   ADD_ALLOC_FLAG(XftFont *, prompt_font);
   ADD_ALLOC_FLAG(char *, clock_format);
   ADD_ALLOC_FLAG(char *, extension_program);
+  ADD_ALLOC_FLAG(char *, cache_directory);
   ADD_ALLOC_FLAG(char *, default_user);
   ADD_ALLOC_FLAG(char *, welcome_message);
   ADD_ALLOC_FLAG(char *, sessions);
@@ -0,0 +1,679 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include "band.h"
+#include "convert.h"
+#include "simd.h"
+#include "util.h"
+
+#define NUM_COLORS 256
+#define INVERSE_BITS 5
+#define INVERSE_SIZE (1 << 3 * INVERSE_BITS)
+
+// Thresholds of a 4x4 ordered dither, in sixteenths.
+static const unsigned char bayer4[16] = {
+  0, 8, 2, 10,
+  12, 4, 14, 6,
+  3, 11, 1, 9,
+  15, 7, 13, 5
+};
+
+
+static void computeShift(unsigned long mask,
+			 unsigned char *left_shift,
+			 unsigned char *right_shift)
+{
+  int left = 0, right = 8;
+  if (mask != 0)
+    {
+      while ((mask & 0x01) == 0)
+	{
+	  left++;
+	  mask >>= 1;
+	}
+      while ((mask & 0x01) == 1)
+	{
+	  right--;
+	  mask >>= 1;
+	}
+    }
+  *left_shift = left;
+  *right_shift = right;
+}
+
+
+// XPutPixel only touches the row it is given, so either of these can
+// run on disjoint rows at the same time.
+
+static inline int inverse_index(int red, int green, int blue)
+{
+  const int drop = 8 - INVERSE_BITS;
+
+  return (red >> drop) << 2 * INVERSE_BITS | (green >> drop) << INVERSE_BITS
+    | blue >> drop;
+}
+
+static inline void put_pseudo(XImage *ximage, int i, int j,
+			      unsigned char *row, unsigned char pixel)
+{
+  if (row)
+    row[i] = pixel;
+  else
+    XPutPixel(ximage, i, j, pixel);
+}
+
+// The dither depends only on where a pixel is, so bands give the same
+// pixels as one pass over the image, and so do strips as long as they
+// are a multiple of 4 rows.  An 8-bit image is written directly.
+static void convert_pseudo(const struct converter *conv, XImage *ximage,
+			   int y, const unsigned char *rgb, int rows)
+{
+  const int width = ximage->width;
+
+  for (int j = y; j < y + rows; j++)
+    {
+      unsigned char *row = ximage->bits_per_pixel != 8 ? NULL
+	: (unsigned char *) ximage->data + j * ximage->bytes_per_line;
+      const short *d = &conv->pseudo_dither[(j & 3) * 4];
+
+      for (int i = 0; i < width; i++, rgb += 3)
+	{
+	  int want[3];
+
+	  for (int k = 0; k < 3; k++)
+	    {
+	      int c = rgb[k] + d[i & 3];
+	      want[k] = c < 0 ? 0 : c > 255 ? 255 : c;
+	    }
+	  put_pseudo(ximage, i, j, row,
+		     conv->inverse[inverse_index(want[0], want[1], want[2])]);
+	}
+    }
+}
+
+static void convert_true(const struct converter *conv, XImage *ximage,
+			 int y, const unsigned char *rgb, int rows)
+{
+  unsigned long pixel;
+  unsigned long red, green, blue;
+
+  for (int j = y; j < y + rows; j++)
+    for (int i = 0; i < ximage->width; i++)
+      {
+	red = *rgb++ >> conv->red_right_shift;
+	green = *rgb++ >> conv->green_right_shift;
+	blue = *rgb++ >> conv->blue_right_shift;
+
+	pixel = (((red << conv->red_left_shift) & conv->red_mask)
+		 | ((green << conv->green_left_shift) & conv->green_mask)
+		 | ((blue << conv->blue_left_shift) & conv->blue_mask));
+
+	XPutPixel(ximage, i, j, pixel);
+      }
+}
+
+
+// Specialised converters for the usual TrueColor layouts write rows
+// straight into the image data.  Channels are scaled as convert_true
+// does for 8 bits or fewer, so these give the same pixels, and wider
+// channels repeat the high bits of the 8-bit value.
+
+#define MIN(A,B) ((A) < (B) ? (A) : (B))
+
+static inline unsigned long pack_channel(const struct converter *conv,
+					 int k, unsigned int c, int d)
+{
+  int width = conv->width[k];
+
+  if (width > 8)
+    return (unsigned long) ((c << (width - 8)) | (c >> (16 - width)))
+      << conv->shift[k];
+  c = MIN(c + conv->dither[k][d], 255);
+  return (unsigned long) (c >> (8 - width)) << conv->shift[k];
+}
+
+static inline unsigned long pack_pixel(const struct converter *conv,
+				       const unsigned char *rgb, int d)
+{
+  return pack_channel(conv, 0, rgb[0], d) | pack_channel(conv, 1, rgb[1], d)
+    | pack_channel(conv, 2, rgb[2], d);
+}
+
+// 32 bits, each channel a whole byte.
+static void convert_bytes32(const struct converter *conv, XImage *ximage,
+			    int y, const unsigned char *rgb, int rows)
+{
+  const unsigned char *offset = conv->offset;
+
+  for (int j = y; j < y + rows; j++)
+    {
+      unsigned char *dst =
+	(unsigned char *) ximage->data + j * ximage->bytes_per_line;
+
+      for (int i = ximage->width; i--; rgb += 3, dst += 4)
+	{
+	  dst[offset[0]] = rgb[0];
+	  dst[offset[1]] = rgb[1];
+	  dst[offset[2]] = rgb[2];
+	  dst[offset[3]] = 0;
+	}
+    }
+}
+
+// 16 bits, in the image's byte order.
+static void convert_packed16(const struct converter *conv, XImage *ximage,
+			     int y, const unsigned char *rgb, int rows)
+{
+  for (int j = y; j < y + rows; j++)
+    {
+      unsigned char *dst =
+	(unsigned char *) ximage->data + j * ximage->bytes_per_line;
+
+      for (int i = 0; i < ximage->width; i++, rgb += 3, dst += 2)
+	{
+	  unsigned short pixel = pack_pixel(conv, rgb, (j & 3) * 4 + (i & 3));
+
+	  if (conv->swap)
+	    pixel = (pixel >> 8) | (pixel << 8);
+	  memcpy(dst, &pixel, 2);
+	}
+    }
+}
+
+// 32 bits with channels of any width, such as 10-bit ones.
+static void convert_packed32(const struct converter *conv, XImage *ximage,
+			     int y, const unsigned char *rgb, int rows)
+{
+  for (int j = y; j < y + rows; j++)
+    {
+      unsigned char *dst =
+	(unsigned char *) ximage->data + j * ximage->bytes_per_line;
+
+      for (int i = 0; i < ximage->width; i++, rgb += 3, dst += 4)
+	{
+	  unsigned int pixel = pack_pixel(conv, rgb, (j & 3) * 4 + (i & 3));
+
+	  if (conv->swap)
+	    pixel = (pixel >> 24) | ((pixel >> 8) & 0xff00)
+	      | ((pixel << 8) & 0xff0000) | (pixel << 24);
+	  memcpy(dst, &pixel, 4);
+	}
+    }
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+// Four RGB pixels to four 32-bit ones with one byte shuffle.  Loads
+// are 16 bytes for 12 used, so leave the last pixels of a row to the
+// scalar loop rather than read past the end.
+TARGET_SSSE3
+static void convert_bytes32_ssse3(const struct converter *conv,
+				  XImage *ximage, int y,
+				  const unsigned char *rgb, int rows)
+{
+  const __m128i shuffle = _mm_loadu_si128((const __m128i *) conv->shuffle);
+  const unsigned char *offset = conv->offset;
+
+  for (int j = y; j < y + rows; j++)
+    {
+      unsigned char *dst =
+	(unsigned char *) ximage->data + j * ximage->bytes_per_line;
+      int i = 0;
+
+      for (; i + 6 <= ximage->width; i += 4, rgb += 12, dst += 16)
+	_mm_storeu_si128((__m128i *) dst,
+			 _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)
+							  rgb),
+					  shuffle));
+      for (; i < ximage->width; i++, rgb += 3, dst += 4)
+	{
+	  dst[offset[0]] = rgb[0];
+	  dst[offset[1]] = rgb[1];
+	  dst[offset[2]] = rgb[2];
+	  dst[offset[3]] = 0;
+	}
+    }
+}
+
+TARGET_AVX2
+static void convert_bytes32_avx2(const struct converter *conv,
+				 XImage *ximage, int y,
+				 const unsigned char *rgb, int rows)
+{
+  const __m256i shuffle =
+    _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)
+						conv->shuffle));
+  const unsigned char *offset = conv->offset;
+
+  for (int j = y; j < y + rows; j++)
+    {
+      unsigned char *dst =
+	(unsigned char *) ximage->data + j * ximage->bytes_per_line;
+      int i = 0;
+
+      for (; i + 10 <= ximage->width; i += 8, rgb += 24, dst += 32)
+	{
+	  __m256i pixels =
+	    _mm256_inserti128_si256(_mm256_castsi128_si256
+				    (_mm_loadu_si128((const __m128i *) rgb)),
+				    _mm_loadu_si128((const __m128i *)
+						    (rgb + 12)), 1);
+	  _mm256_storeu_si256((__m256i *) dst,
+			      _mm256_shuffle_epi8(pixels, shuffle));
+	}
+      for (; i < ximage->width; i++, rgb += 3, dst += 4)
+	{
+	  dst[offset[0]] = rgb[0];
+	  dst[offset[1]] = rgb[1];
+	  dst[offset[2]] = rgb[2];
+	  dst[offset[3]] = 0;
+	}
+    }
+}
+
+// Eight pixels at a time in 16-bit lanes.  Only for channels of 8 bits
+// or fewer, which is all that fits in 16 bits anyway.
+TARGET_SSSE3
+static void convert_packed16_ssse3(const struct converter *conv,
+				   XImage *ximage, int y,
+				   const unsigned char *rgb, int rows)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i max = _mm_set1_epi16(255);
+  const __m128i swap =
+    _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+  __m128i select_low[3], select_high[3], right[3], left[3];
+
+  for (int k = 0; k < 3; k++)
+    {
+      select_low[k] = _mm_setr_epi8(k, -1, k + 3, -1, k + 6, -1, k + 9, -1,
+				    -1, -1, -1, -1, -1, -1, -1, -1);
+      select_high[k] = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+				     k, -1, k + 3, -1, k + 6, -1, k + 9, -1);
+      right[k] = _mm_cvtsi32_si128(8 - conv->width[k]);
+      left[k] = _mm_cvtsi32_si128(conv->shift[k]);
+    }
+
+  for (int j = y; j < y + rows; j++)
+    {
+      unsigned char *dst =
+	(unsigned char *) ximage->data + j * ximage->bytes_per_line;
+      const unsigned char *d = &conv->dither[0][(j & 3) * 4];
+      __m128i dither[3];
+      int i = 0;
+
+      for (int k = 0; k < 3; k++, d += 16)
+	dither[k] = _mm_setr_epi16(d[0], d[1], d[2], d[3],
+				   d[0], d[1], d[2], d[3]);
+
+      for (; i + 10 <= ximage->width; i += 8, rgb += 24, dst += 16)
+	{
+	  __m128i low = _mm_loadu_si128((const __m128i *) rgb);
+	  __m128i high = _mm_loadu_si128((const __m128i *) (rgb + 12));
+	  __m128i pixels = zero;
+
+	  for (int k = 0; k < 3; k++)
+	    {
+	      __m128i c = _mm_or_si128(_mm_shuffle_epi8(low, select_low[k]),
+				       _mm_shuffle_epi8(high,
+							select_high[k]));
+	      c = _mm_min_epi16(_mm_add_epi16(c, dither[k]), max);
+	      pixels = _mm_or_si128(pixels,
+				    _mm_sll_epi16(_mm_srl_epi16(c, right[k]),
+						  left[k]));
+	    }
+	  if (conv->swap)
+	    pixels = _mm_shuffle_epi8(pixels, swap);
+	  _mm_storeu_si128((__m128i *) dst, pixels);
+	}
+
+      for (; i < ximage->width; i++, rgb += 3, dst += 2)
+	{
+	  unsigned short pixel = pack_pixel(conv, rgb, (j & 3) * 4 + (i & 3));
+
+	  if (conv->swap)
+	    pixel = (pixel >> 8) | (pixel << 8);
+	  memcpy(dst, &pixel, 2);
+	}
+    }
+}
+
+#define SIMD_FN(FN) FN
+#else
+#define SIMD_FN(FN) NULL
+#endif /* HAVE_X86_SIMD */
+
+
+static int bytes32_usable(const struct converter *conv)
+{
+  for (int k = 0; k < 3; k++)
+    if (conv->width[k] != 8 || conv->shift[k] % 8)
+      return 0;
+  return 1;
+}
+
+static int packed16_usable(const struct converter *conv)
+{
+  for (int k = 0; k < 3; k++)
+    if (conv->width[k] < 1 || conv->width[k] > 8)
+      return 0;
+  return 1;
+}
+
+static int packed32_usable(const struct converter *conv)
+{
+  for (int k = 0; k < 3; k++)
+    if (conv->width[k] < 1 || conv->width[k] > 16)
+      return 0;
+  return 1;
+}
+
+// First match wins, and the fastest kernel the CPU runs.
+static const struct
+{
+  int bits_per_pixel;
+  int (*usable)(const struct converter *conv);
+  void (*scalar)(const struct converter *, XImage *, int,
+		 const unsigned char *, int);
+  void (*ssse3)(const struct converter *, XImage *, int,
+		const unsigned char *, int);
+  void (*avx2)(const struct converter *, XImage *, int,
+	       const unsigned char *, int);
+} true_converters[] = {
+  {32, bytes32_usable, convert_bytes32,
+   SIMD_FN(convert_bytes32_ssse3), SIMD_FN(convert_bytes32_avx2)},
+  {16, packed16_usable, convert_packed16,
+   SIMD_FN(convert_packed16_ssse3), NULL},
+  {32, packed32_usable, convert_packed32, NULL, NULL},
+};
+
+
+static int use_dither;
+
+// Dither visuals with fewer than 8 bits per channel.
+void convert_set_dither(int dither)
+{
+  use_dither = dither;
+}
+
+
+static int host_byte_order(void)
+{
+  union { unsigned short s; unsigned char c[2]; } probe = {1};
+
+  return probe.c[0] ? LSBFirst : MSBFirst;
+}
+
+
+// Work out the layout of the pixels and pick a converter for it,
+// keeping convert_true for anything unusual.
+static void init_true(struct converter *conv, Display *dpy, int scr)
+{
+  unsigned long masks[3] = {conv->red_mask, conv->green_mask,
+			    conv->blue_mask};
+  XPixmapFormatValues *formats;
+  int entries, depth = DefaultDepth(dpy, scr);
+
+  conv->convert = convert_true;
+  if ((formats = XListPixmapFormats(dpy, &entries)))
+    {
+      for (int i = 0; i < entries; i++)
+	if (formats[i].depth == depth)
+	  conv->bits_per_pixel = formats[i].bits_per_pixel;
+      XFree(formats);
+    }
+  conv->byte_order = ImageByteOrder(dpy);
+  conv->swap = conv->byte_order != host_byte_order();
+
+  for (int k = 0; k < 3; k++)
+    {
+      unsigned long mask = masks[k];
+
+      if (!mask)
+	return;
+      for (; !(mask & 1); mask >>= 1)
+	conv->shift[k]++;
+      for (; mask & 1; mask >>= 1)
+	conv->width[k]++;
+      // Not one run of bits.
+      if (mask)
+	return;
+      if (use_dither && conv->width[k] < 8)
+	for (int d = 0; d < 16; d++)
+	  conv->dither[k][d] = (bayer4[d] << (8 - conv->width[k])) / 16;
+    }
+
+  // Which byte of a 32-bit pixel each channel is in.
+  int pad = 0 + 1 + 2 + 3;
+  for (int k = 0; k < 3; k++)
+    {
+      int byte = conv->shift[k] / 8;
+
+      conv->offset[k] = conv->byte_order == LSBFirst ? byte : 3 - byte;
+      pad -= conv->offset[k];
+    }
+  conv->offset[3] = pad;
+  for (int i = 0; i < 16; i++)
+    {
+      conv->shuffle[i] = 0x80;
+      for (int k = 0; k < 3; k++)
+	if (i % 4 == conv->offset[k])
+	  conv->shuffle[i] = 3 * (i / 4) + k;
+    }
+
+  for (int i = 0; i < sizeof(true_converters) / sizeof(true_converters[0]);
+       i++)
+    if (true_converters[i].bits_per_pixel == conv->bits_per_pixel
+	&& true_converters[i].usable(conv))
+      {
+	conv->convert = true_converters[i].scalar;
+#ifdef HAVE_X86_SIMD
+	if (true_converters[i].ssse3 && CPU_HAS("ssse3"))
+	  conv->convert = true_converters[i].ssse3;
+	if (true_converters[i].avx2 && CPU_HAS("avx2"))
+	  conv->convert = true_converters[i].avx2;
+#endif
+	break;
+      }
+}
+
+
+// The inverse colormap of the last colormap seen.  The greeter makes a
+// converter for each image it puts up, and the colormap rarely changes
+// in between.
+static struct
+{
+  Colormap colormap;
+  int size;
+  unsigned char colors[3 * NUM_COLORS];
+  unsigned char inverse[INVERSE_SIZE];
+} pseudo_cache;
+
+// Find the nearest of SIZE COLORS to the middle of every cell of the
+// 5-5-5 table.  Squared distances along each axis grow by a constant
+// second difference, so the walk over the cells needs only additions.
+// The first of equally near colors wins.
+static void build_inverse(const unsigned char *colors, int size,
+			  unsigned char *inverse)
+{
+  const int step = 1 << (8 - INVERSE_BITS);
+  const int second = 2 * step * step;
+  unsigned int *dist = xmalloc(INVERSE_SIZE * sizeof(unsigned int));
+
+  memset(dist, 0xff, INVERSE_SIZE * sizeof(unsigned int));
+  for (int c = 0; c < size; c++)
+    {
+      int d0[3];
+      unsigned int *d = dist;
+      unsigned char *p = inverse;
+
+      for (int k = 0; k < 3; k++)
+	d0[k] = step / 2 - colors[3 * c + k];
+
+      int rdist = d0[0] * d0[0], rinc = 2 * step * d0[0] + step * step;
+      for (int r = 0; r < 1 << INVERSE_BITS; r++)
+	{
+	  int gdist = rdist + d0[1] * d0[1];
+	  int ginc = 2 * step * d0[1] + step * step;
+
+	  for (int g = 0; g < 1 << INVERSE_BITS; g++)
+	    {
+	      unsigned int bdist = gdist + d0[2] * d0[2];
+	      int binc = 2 * step * d0[2] + step * step;
+
+	      for (int b = 0; b < 1 << INVERSE_BITS; b++, d++, p++)
+		{
+		  if (bdist < *d)
+		    {
+		      *d = bdist;
+		      *p = c;
+		    }
+		  bdist += binc;
+		  binc += second;
+		}
+	      gdist += ginc;
+	      ginc += second;
+	    }
+	  rdist += rinc;
+	  rinc += second;
+	}
+    }
+  free(dist);
+}
+
+
+static void init_pseudo(struct converter *conv, Display *dpy, int scr,
+			int size)
+{
+  Colormap colormap = DefaultColormap(dpy, scr);
+  unsigned char rgb[3 * NUM_COLORS];
+  XColor *colors;
+
+  // Pixels are colormap indexes, and have to fit in a byte.
+  if (size > NUM_COLORS)
+    size = NUM_COLORS;
+  colors = xmalloc(sizeof(XColor) * size);
+  for (unsigned int i = 0; i < size; i++)
+    colors[i].pixel = i;
+  XQueryColors(dpy, colormap, colors, size);
+  for (int i = 0; i < size; i++)
+    {
+      rgb[3 * i] = colors[i].red >> 8;
+      rgb[3 * i + 1] = colors[i].green >> 8;
+      rgb[3 * i + 2] = colors[i].blue >> 8;
+    }
+  free(colors);
+
+  if (pseudo_cache.colormap != colormap || pseudo_cache.size != size
+      || memcmp(pseudo_cache.colors, rgb, 3 * size))
+    {
+      pseudo_cache.colormap = colormap;
+      pseudo_cache.size = size;
+      memcpy(pseudo_cache.colors, rgb, 3 * size);
+      build_inverse(rgb, size, pseudo_cache.inverse);
+    }
+
+  conv->inverse = pseudo_cache.inverse;
+  conv->colors = pseudo_cache.colors;
+  conv->convert = convert_pseudo;
+
+  // Spread each channel over about the gap between the levels a color
+  // cube of SIZE entries would have, centred on the pixel's own value.
+  if (use_dither)
+    {
+      int levels = 1;
+
+      while ((levels + 1) * (levels + 1) * (levels + 1) <= size)
+	levels++;
+      for (int d = 0; d < 16; d++)
+	conv->pseudo_dither[d] = (2 * bayer4[d] - 15) * 256 / (32 * levels);
+    }
+}
+
+
+// Returns 0 if the default visual isn't one we can draw on.
+int converter_init(struct converter *conv, Display *dpy, int scr)
+{
+  int entries;
+  XVisualInfo v_template;
+  v_template.visualid = XVisualIDFromVisual(DefaultVisual(dpy, scr));
+  XVisualInfo *visual_info = XGetVisualInfo(dpy, VisualIDMask,
+					    &v_template, &entries);
+
+  memset(conv, 0, sizeof(*conv));
+  if (!visual_info)
+    return 0;
+
+  switch (visual_info->class)
+    {
+    case PseudoColor:
+      init_pseudo(conv, dpy, scr, visual_info->colormap_size);
+      break;
+    case TrueColor:
+      conv->red_mask = visual_info->red_mask;
+      conv->green_mask = visual_info->green_mask;
+      conv->blue_mask = visual_info->blue_mask;
+      computeShift(conv->red_mask, &conv->red_left_shift,
+		   &conv->red_right_shift);
+      computeShift(conv->green_mask, &conv->green_left_shift,
+		   &conv->green_right_shift);
+      computeShift(conv->blue_mask, &conv->blue_left_shift,
+		   &conv->blue_right_shift);
+      init_true(conv, dpy, scr);
+      break;
+    }
+
+  XFree(visual_info);
+  return conv->convert != NULL;
+}
+
+
+// The colormap tables stay cached for the next converter.
+void converter_free(struct converter *conv)
+{
+  conv->inverse = NULL;
+  conv->colors = NULL;
+}
+
+
+// Fill ROWS rows of XIMAGE starting at row Y from packed RGB.
+void convert_rows(const struct converter *conv, XImage *ximage, int y,
+		  const unsigned char *rgb, int rows)
+{
+  // The specialised converters assume the format they were chosen for.
+  if (conv->convert != convert_true && conv->convert != convert_pseudo
+      && (ximage->bits_per_pixel != conv->bits_per_pixel
+	  || ximage->byte_order != conv->byte_order))
+    convert_true(conv, ximage, y, rgb, rows);
+  else
+    conv->convert(conv, ximage, y, rgb, rows);
+}
+
+
+struct convert_job
+{
+  const struct converter *conv;
+  XImage *ximage;
+  const unsigned char *rgb;
+};
+
+static void convert_band(void *arg, int first, int end)
+{
+  struct convert_job *job = arg;
+
+  convert_rows(job->conv, job->ximage, first,
+	       job->rgb + 3 * job->ximage->width * first, end - first);
+}
+
+
+// All of XIMAGE, from an RGB image of the same size.
+void convert_image(const struct converter *conv, XImage *ximage,
+		   const unsigned char *rgb)
+{
+  struct convert_job job = {conv, ximage, rgb};
+
+  band_run(ximage->height, convert_band, &job);
+}
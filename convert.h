@@ -0,0 +1,33 @@
+#ifndef _CONVERT_H_
+#define _CONVERT_H_
+
+// Turns rows of packed RGB into pixels of the default visual.
+struct converter
+{
+  void (*convert)(const struct converter *conv, XImage *ximage, int y,
+		  const unsigned char *rgb, int rows);
+  int bits_per_pixel, byte_order, swap;
+  // PseudoColor: the pixel for each 5-5-5 RGB and the RGB of each
+  // pixel, both shared with the colormap cache.
+  const unsigned char *inverse, *colors;
+  short pseudo_dither[16];	// PseudoColor: 4x4 ordered dither.
+  unsigned long red_mask, green_mask, blue_mask;
+  unsigned char red_left_shift, red_right_shift;
+  unsigned char green_left_shift, green_right_shift;
+  unsigned char blue_left_shift, blue_right_shift;
+  // Channels in red, green, blue order.
+  unsigned char shift[3], width[3];	// Lowest bit and bit count.
+  unsigned char offset[4];		// 32bpp bytes, then the pad byte.
+  unsigned char dither[3][16];		// 4x4 ordered dither, or zeros.
+  unsigned char shuffle[16];		// 32bpp bytes from 4 RGB pixels.
+};
+
+void convert_set_dither(int dither);
+int converter_init(struct converter *conv, Display *dpy, int scr);
+void converter_free(struct converter *conv);
+void convert_rows(const struct converter *conv, XImage *ximage, int y,
+		  const unsigned char *rgb, int rows);
+void convert_image(const struct converter *conv, XImage *ximage,
+		   const unsigned char *rgb);
+
+#endif /* _CONVERT_H_ */
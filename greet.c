@@ -19,10 +19,18 @@
 
 #include <poll.h>
 
+#include "band.h"
+#include "cache.h"
+#include "convert.h"
 #include "image.h"
+#include "read.h"
+#include "render.h"
+#include "rotate.h"
+#include "stream.h"
 #include "cfg.h"
 #include "gfx.h"
 #include "text.h"
+#include "upload.h"
 
 
 #define USER_PARAM_NAME "GLEEM_USER_PARAM"
@@ -166,6 +174,60 @@ void show_cursor(Display *dpy, Window win)
 }
 
 
+// A screen of the background color with VISIBLE, a WIDTH x HEIGHT
+// centered or fitted image, at X, Y.
+static Pixmap centered_pixmap(Display *dpy, Gfx *gfx, Cfg *cfg,
+			      Pixmap visible, int width, int height,
+			      int x, int y)
+{
+  Pixmap pixmap = XCreatePixmap(dpy, gfx->background_win,
+				cfg->screen_specs.width,
+				cfg->screen_specs.height,
+				DefaultDepth(dpy, gfx->screen));
+  XGCValues values;
+  GC gc;
+
+  values.foreground = cfg->background_color.pixel;
+  gc = XCreateGC(dpy, pixmap, GCForeground, &values);
+  XFillRectangle(dpy, pixmap, gc, 0, 0, cfg->screen_specs.width,
+		 cfg->screen_specs.height);
+  XCopyArea(dpy, visible, pixmap, gc, 0, 0, width, height, x, y);
+  XFreeGC(dpy, gc);
+  return pixmap;
+}
+
+
+// The solid or TILE background under the panel, for the server to
+// blend the panel with.
+static Pixmap backdrop_pixmap(Display *dpy, Gfx *gfx, Cfg *cfg, Pixmap tile)
+{
+  const int width = cfg->panel_image.width, height = cfg->panel_image.height;
+  Pixmap backdrop = XCreatePixmap(dpy, gfx->background_win, width, height,
+				  DefaultDepth(dpy, gfx->screen));
+  XGCValues values;
+  unsigned long mask;
+  GC gc;
+
+  if (tile)
+    {
+      values.fill_style = FillTiled;
+      values.tile = tile;
+      values.ts_x_origin = -cfg->panel_position.x;
+      values.ts_y_origin = -cfg->panel_position.y;
+      mask = GCFillStyle | GCTile | GCTileStipXOrigin | GCTileStipYOrigin;
+    }
+  else
+    {
+      values.foreground = cfg->background_color.pixel;
+      mask = GCForeground;
+    }
+  gc = XCreateGC(dpy, backdrop, mask, &values);
+  XFillRectangle(dpy, backdrop, gc, 0, 0, width, height);
+  XFreeGC(dpy, gc);
+  return backdrop;
+}
+
+
 void show_input_prompts(Cfg *cfg, Gfx *gfx, int active_field)
 {
   if (!reuse_input_area)
@@ -367,10 +429,13 @@ greet_user_rtn GreetUser(
 
 {
   Display *dpy;
-  Pixmap pixmap;
+  Pixmap pixmap, background_pixmap;
   Cfg *cfg;
   Gfx gfx;
   char *message = NULL;
+  int background_x = 0, background_y = 0;	// background_image on screen.
+  int composite, server_drawn, streamed;
+  int center_x = 0, center_y = 0;	// Of a centered background_image.
 
   /*
    * These must be set before they are used.
@@ -414,6 +479,7 @@ greet_user_rtn GreetUser(
     __xdm_SetupDisplay(d);
   dpy = gfx.dpy;
   cfg = get_cfg(dpy);
+  convert_set_dither(cfg->dither);
 
   if (cfg->theme_username_prompt)
     cfg->username_prompt = cfg->theme_username_prompt;
@@ -433,30 +499,151 @@ greet_user_rtn GreetUser(
 					   0, 0, 255);
   gfx.background_draw = XftDrawCreate(dpy, gfx.background_win,
 				      gfx.visual, gfx.colormap);
-  if (cfg->background_image.width > 0)
-    resize_background(&cfg->background_image, cfg->screen_specs.width,
-		      cfg->screen_specs.height);
-  else
-    frame_background(&cfg->background_image,
-		     cfg->screen_specs.width, cfg->screen_specs.height,
-		     cfg->screen_specs.width + 1, 0, &cfg->background_color);
-  pixmap = imageToPixmap(dpy, &cfg->background_image,
-			 gfx.screen, gfx.background_win);
-  XSetWindowBackgroundPixmap(dpy, gfx.background_win, pixmap);
-  XClearWindow(dpy, gfx.background_win);
-  XFreePixmap(dpy, pixmap);
-  if (cfg->panel_image.width == 0)
+  if (!cfg->panel_filename)
     {
+      // The plain panel is just a rectangle of color.
       cfg->input_highlight = 1;
-      frame_background(&cfg->panel_image,
-		       DEFAULT_PANEL_WIDTH, DEFAULT_PANEL_HEIGHT,
-		       cfg->screen_specs.width + 1, 0, &cfg->panel_color);
+      cfg->panel_image.width = DEFAULT_PANEL_WIDTH;
+      cfg->panel_image.height = DEFAULT_PANEL_HEIGHT;
     }
   TRANSLATE_POSITION(&cfg->panel_position, cfg->panel_image.width,
 		     cfg->panel_image.height, cfg, 0);
-  merge_with_background(&cfg->panel_image,
-			&cfg->background_image,
-			TO_XY(cfg->panel_position));
+  // Solid and tiled backgrounds are left to the server to draw.
+  server_drawn = cfg->background_style == STYLE_COLOR
+    || cfg->background_style == STYLE_TILE;
+  streamed = cfg->stream_background
+    && cfg->background_style == STYLE_STRETCH
+    && cfg->background_rotate == ORIENT_NORMAL && !cfg->background_cache.data;
+  // Have the server lay the panel over the background if it can.
+  composite = !cfg->panel_cache.data && !streamed
+    && image_has_alpha(&cfg->panel_image) && render_usable(dpy, gfx.screen);
+  if (cfg->background_style == STYLE_COLOR)
+    {
+      pixmap = None;
+      XSetWindowBackground(dpy, gfx.background_win,
+			   cfg->background_color.pixel);
+    }
+  else if (cfg->background_style == STYLE_TILE)
+    // Window background pixmaps repeat, so only the tile goes up.
+    pixmap = imageToPixmap(dpy, &cfg->background_image,
+			   gfx.screen, gfx.background_win, NULL);
+  else if (cfg->background_style == STYLE_CENTER
+	   || cfg->background_style == STYLE_FIT)
+    {
+      // Only the part that shows was read.  A centered one goes up as
+      // it is and a fitted one is scaled first; the server fills the
+      // rest of the screen.
+      int width = cfg->background_image.width;
+      int height = cfg->background_image.height;
+      Pixmap visible = None;
+
+      if (cfg->background_cache.data)
+	visible = cacheToPixmap(dpy, &cfg->background_cache,
+				gfx.screen, gfx.background_win);
+      else if (cfg->background_style == STYLE_FIT)
+	{
+	  fit_size(width, height, cfg->screen_specs.width,
+		   cfg->screen_specs.height, &width, &height);
+	  // The merge below needs the scaled pixels here.
+	  if (cfg->render_scale
+	      && (composite || !image_has_alpha(&cfg->panel_image)))
+	    visible = scaleToPixmap(dpy, &cfg->background_image, gfx.screen,
+				    gfx.background_win, width, height,
+				    cfg->background_filter);
+	  if (!visible)
+	    resize_background(&cfg->background_image, width, height,
+			      cfg->background_filter);
+	}
+      if (!visible)
+	visible = imageToPixmap(dpy, &cfg->background_image,
+				gfx.screen, gfx.background_win,
+				&cfg->background_cache);
+
+      center_x = ((int) cfg->screen_specs.width - width) / 2;
+      center_y = ((int) cfg->screen_specs.height - height) / 2;
+      pixmap = centered_pixmap(dpy, &gfx, cfg, visible, width, height,
+			       center_x, center_y);
+      XFreePixmap(dpy, visible);
+    }
+  else if (cfg->background_cache.data)
+    pixmap = cacheToPixmap(dpy, &cfg->background_cache,
+			   gfx.screen, gfx.background_win);
+  else if (streamed)
+    // Merges the panel as it goes.
+    pixmap = streamToPixmap(dpy, cfg->background_rows,
+			    &cfg->background_color,
+			    cfg->screen_specs.width, cfg->screen_specs.height,
+			    cfg->background_filter,
+			    cfg->panel_cache.data ? NULL : &cfg->panel_image,
+			    TO_XY(cfg->panel_position),
+			    gfx.screen, gfx.background_win,
+			    &cfg->background_cache);
+  else if (cfg->render_scale
+	   && (pixmap = scaleToPixmap(dpy, &cfg->background_image,
+				      gfx.screen, gfx.background_win,
+				      cfg->screen_specs.width,
+				      cfg->screen_specs.height,
+				      cfg->background_filter)))
+    {
+      // Only what is under the panel comes back, for the merge.
+      if (image_has_alpha(&cfg->panel_image) && !composite)
+	{
+	  int x = cfg->panel_position.x, y = cfg->panel_position.y;
+	  int right = x + cfg->panel_image.width;
+	  int bottom = y + cfg->panel_image.height;
+
+	  background_x = x > 0 ? x : 0;
+	  background_y = y > 0 ? y : 0;
+	  if (right > (int) cfg->screen_specs.width)
+	    right = cfg->screen_specs.width;
+	  if (bottom > (int) cfg->screen_specs.height)
+	    bottom = cfg->screen_specs.height;
+	  imageFromPixmap(dpy, pixmap, gfx.screen, background_x, background_y,
+			  right - background_x, bottom - background_y,
+			  &cfg->background_image);
+	}
+    }
+  else
+    {
+      resize_background(&cfg->background_image, cfg->screen_specs.width,
+			cfg->screen_specs.height, cfg->background_filter);
+      pixmap = imageToPixmap(dpy, &cfg->background_image,
+			     gfx.screen, gfx.background_win,
+			     &cfg->background_cache);
+    }
+  if (pixmap)
+    XSetWindowBackgroundPixmap(dpy, gfx.background_win, pixmap);
+  XClearWindow(dpy, gfx.background_win);
+  background_pixmap = pixmap;
+
+  // For a drawn, centered or fitted background, make just the part
+  // under the panel to merge with.  The server can take that from a
+  // centered or fitted background's pixmap as it is.
+  if ((server_drawn
+       || (!composite && (cfg->background_style == STYLE_CENTER
+			  || cfg->background_style == STYLE_FIT)))
+      && image_has_alpha(&cfg->panel_image) && !cfg->panel_cache.data)
+    {
+      background_x = cfg->panel_position.x;
+      background_y = cfg->panel_position.y;
+      if (composite)
+	background_pixmap = backdrop_pixmap(dpy, &gfx, cfg, pixmap);
+      else if (cfg->background_style == STYLE_TILE)
+	tile_background(&cfg->background_image, cfg->panel_image.width,
+			cfg->panel_image.height, -background_x, -background_y);
+      else
+	// Without a centered or fitted image this is just the color.
+	frame_background(&cfg->background_image, cfg->panel_image.width,
+			 cfg->panel_image.height, center_x - background_x,
+			 center_y - background_y, &cfg->background_color);
+      if (pixmap && composite)
+	XFreePixmap(dpy, pixmap);
+    }
+  if (!cfg->panel_cache.data && !streamed && !composite)
+    merge_with_background(&cfg->panel_image,
+			  &cfg->background_image,
+			  cfg->panel_position.x - background_x,
+			  cfg->panel_position.y - background_y);
   free_image_buffers(&cfg->background_image);
   gfx.panel_win = XCreateSimpleWindow(dpy, gfx.background_win,
 				      TO_XY(cfg->panel_position),
@@ -465,11 +652,37 @@ greet_user_rtn GreetUser(
 				      0, 0, 255);
   gfx.panel_draw = XftDrawCreate(dpy, gfx.panel_win,
 				 gfx.visual, gfx.colormap);
-  pixmap = imageToPixmap(dpy, &cfg->panel_image, gfx.screen, gfx.panel_win);
+  if (cfg->panel_cache.data)
+    pixmap = cacheToPixmap(dpy, &cfg->panel_cache, gfx.screen, gfx.panel_win);
+  else if (!cfg->panel_filename)
+    {
+      pixmap = None;
+      XSetWindowBackground(dpy, gfx.panel_win, cfg->panel_color.pixel);
+    }
+  else if (composite)
+    pixmap = render_panel(dpy, gfx.screen, gfx.panel_win, background_pixmap,
+			  cfg->panel_position.x - background_x,
+			  cfg->panel_position.y - background_y,
+			  &cfg->panel_image, &cfg->panel_cache);
+  else
+    pixmap = imageToPixmap(dpy, &cfg->panel_image, gfx.screen, gfx.panel_win,
+			   &cfg->panel_cache);
+  if (background_pixmap)
+    XFreePixmap(dpy, background_pixmap);
   free_image_buffers(&cfg->panel_image);
-  XSetWindowBackgroundPixmap(dpy, gfx.panel_win, pixmap);
+  cache_release(&cfg->background_cache);
+  cache_release(&cfg->panel_cache);
+  band_shutdown();
+  const struct upload_stats *stats = upload_get_stats();
+  Debug("Image upload: %d MIT-SHM puts (%lu bytes), "
+	"%d XPutImage (%lu bytes), %d MIT-SHM failures\n",
+	stats->shm_puts, stats->shm_bytes,
+	stats->plain_puts, stats->plain_bytes, stats->shm_failures);
+  if (pixmap)
+    XSetWindowBackgroundPixmap(dpy, gfx.panel_win, pixmap);
   XClearWindow(dpy, gfx.panel_win);
-  XFreePixmap(dpy, pixmap);
+  if (pixmap)
+    XFreePixmap(dpy, pixmap);
   XMapWindow(dpy, gfx.background_win);
   XMapWindow(dpy, gfx.panel_win);
 
@@ -4,314 +4,642 @@
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
 #include <X11/Xmu/WinUtil.h>
+#include "band.h"
+#include "blend.h"
+#include "cache.h"
+#include "convert.h"
 #include "image.h"
 #include "util.h"
 #include "read.h"
+#include "resample.h"
+#include "rotate.h"
+#include "upload.h"
+
+// Rows that resizing, framing or tiling make in a 32-bit layout start
+// on 16 bytes; the rest stay packed for the converter.  What
+// read_image hands back is packed in every layout, so nothing may
+// count on the alignment: image->stride is the truth, and the vector
+// kernels all load unaligned.
+static int image_stride(int width, int layout)
+{
+  if (layout_channels[layout][0] != 4)
+    return layout_channels[layout][0] * width;
+  return (4 * width + 15) & ~15;
+}
 
-#define NUM_COLORS 256
+static int is_compact(const struct image *image)
+{
+  return image->layout == LAYOUT_GRAY || image->layout == LAYOUT_INDEXED;
+}
 
-int read_image(const char *filename, struct image *image)
+// The 256 colors a gray or indexed pixel can be, as RGB.
+static void compact_colors(const struct image *image, unsigned char *rgb)
 {
-  char buf[4];
-  unsigned char *ubuf = (unsigned char *) buf;
-  int success = 0;
-  FILE *file;
+  if (image->layout == LAYOUT_INDEXED)
+    memcpy(rgb, image->palette, 3 * 256);
+  else
+    for (int i = 0; i < 256; i++)
+      memset(rgb + 3 * i, i, 3);
+}
 
-  if (image->rgb_data)
-    free(image->rgb_data);
-  if (image->alpha_data)
-    free(image->alpha_data);
+// Look up N one-byte pixels in COLORS, which has BYTES per entry.
+static inline void expand_row(const unsigned char *src, const unsigned char *colors,
+		       int bytes, unsigned char *dst, int n)
+{
+  for (int i = 0; i < n; i++, dst += bytes)
+    memcpy(dst, colors + bytes * src[i], bytes);
+}
 
-  if ((file = fopen(filename, "rb")) == NULL)
-    return 0;
+static void free_alpha(struct image *image)
+{
+  free(image->alpha_data);
+  image->alpha_data = NULL;
+  alpha_spans_free(image->spans);
+  image->spans = NULL;
+}
 
-  if (fread(buf, 1, 4, file) == 4)
+// RGB_DATA may lie in the mapping of the file it was read from.  The
+// mapping is private and writable, so the pixels can be changed in
+// place like any others, but they are freed only with it.
+static void free_pixels(struct image *image)
+{
+  if (image->file)
     {
-      rewind(file);
-      if ((ubuf[0] == 0x89) && !strncmp("PNG", buf + 1, 3))
-	success = read_png(file, filename,
-			   &image->width, &image->height,
-			   &image->rgb_data, &image->alpha_data);
-      else if ((ubuf[0] == 0xff) && (ubuf[1] == 0xd8))
-	success =
-	  read_jpeg(file, filename,
-		    &image->width, &image->height,
-		    &image->rgb_data, &image->alpha_data);
-      else
-	fprintf(stderr, "Unknown image format\n");
-      
-      image->area = image->width * image->height;
+      unmap_file(image->file);
+      free(image->file);
+      image->file = NULL;
     }
+  else
+    free(image->rgb_data);
+  image->rgb_data = NULL;
+}
 
-  fclose(file);
-  return (success == 1);
+// Copy pixels out of a mapping, for what has to reallocate them.
+static void own_pixels(struct image *image)
+{
+  size_t size = (size_t) image->stride * image->height;
+  unsigned char *rgb;
+
+  if (!image->file)
+    return;
+  rgb = xmalloc(size);
+  memcpy(rgb, image->rgb_data, size);
+  free_pixels(image);
+  image->rgb_data = rgb;
 }
 
+// Only where a gray or indexed image can't be used as it is.
+static void expand_to_rgb(struct image *image)
+{
+  unsigned char colors[3 * 256];
+  unsigned char *rgb;
 
-void free_image_buffers(struct image *image)
+  if (!is_compact(image))
+    return;
+  compact_colors(image, colors);
+  rgb = xmalloc((size_t) 3 * image->area);
+  for (int j = 0; j < image->height; j++)
+    expand_row(image->rgb_data + (size_t) image->stride * j, colors, 3,
+	       rgb + (size_t) 3 * image->width * j, image->width);
+  free_pixels(image);
+  free(image->palette);
+  image->rgb_data = rgb;
+  image->palette = NULL;
+  image->layout = LAYOUT_RGB;
+  image->stride = 3 * image->width;
+}
+
+
+#define FORMAT_UNKNOWN 0
+#define FORMAT_PNG 1
+#define FORMAT_JPEG 2
+#define FORMAT_QOI 3
+#define FORMAT_RAW 4
+
+static int image_format(const struct file_data *file)
 {
-  free(image->rgb_data);
-  image->rgb_data = NULL;
-  free(image->alpha_data);
-  image->alpha_data = NULL;
+  const unsigned char *data = file->data;
+
+  if (file->size >= 4 && data[0] == 0x89
+      && !strncmp("PNG", (const char *) data + 1, 3))
+    return FORMAT_PNG;
+  if (file->size >= 2 && data[0] == 0xff && data[1] == 0xd8)
+    return FORMAT_JPEG;
+  if (file->size >= 4 && !memcmp(data, "qoif", 4))
+    return FORMAT_QOI;
+  if (file->size >= 8 && !memcmp(data, "gleemraw", 8))
+    return FORMAT_RAW;
+  fprintf(stderr, "Unknown image format\n");
+  return FORMAT_UNKNOWN;
+}
+
+
+// Whether IMAGE has alpha, in a plane or in its pixels.
+int image_has_alpha(const struct image *image)
+{
+  return image->alpha_data || LAYOUT_HAS_ALPHA(image->layout);
+}
+
+
+// Index the alpha afresh once it has been moved about, if the reader
+// indexed it at all.  Rows are packed, as read_image leaves them.
+static void reindex_alpha(struct image *image)
+{
+  const int in_pixels = LAYOUT_HAS_ALPHA(image->layout);
+  const unsigned char *alpha = in_pixels
+    ? image->rgb_data + layout_alpha[image->layout] : image->alpha_data;
+  const int step = in_pixels ? 4 : 1;
+
+  if (!image->spans)
+    return;
+  alpha_spans_free(image->spans);
+  image->spans = alpha_spans_new(image->height);
+  for (int j = 0; j < image->height; j++)
+    alpha_spans_add_row(image->spans,
+			alpha + (size_t) step * image->width * j,
+			image->width, step);
 }
 
 
-static void computeShift(unsigned long mask,
-			 unsigned char *left_shift,
-			 unsigned char *right_shift)
+// Cut IMAGE down to what FRAME keeps of it, for readers that can't skip
+// what is left out.
+static void crop_frame(struct image *image, int frame,
+		       int min_width, int min_height)
 {
-  int left = 0, right = 8;
-  if (mask != 0)
+  const int bytes = layout_channels[image->layout][0];
+  int x, y, w, h;
+
+  frame_window(frame, image->width, image->height, min_width, min_height,
+	       &x, &y, &w, &h);
+
+  if (w == image->width && h == image->height)
+    return;
+
+  image->stride = bytes * image->width;
+  own_pixels(image);
+  // Each row moves down in memory, never past one still to be moved.
+  for (int j = 0; j < h; j++)
+    memmove(image->rgb_data + (size_t) bytes * w * j,
+	    image->rgb_data + (size_t) bytes * (image->width * (y + j) + x),
+	    bytes * w);
+  image->rgb_data = xrealloc(image->rgb_data, (size_t) bytes * w * h);
+  if (image->alpha_data)
     {
-      while ((mask & 0x01) == 0)
-	{
-	  left++;
-	  mask >>= 1;
-	}
-      while ((mask & 0x01) == 1)
+      for (int j = 0; j < h; j++)
+	memmove(image->alpha_data + (size_t) w * j,
+		image->alpha_data + (size_t) image->width * (y + j) + x, w);
+      image->alpha_data = xrealloc(image->alpha_data, (size_t) w * h);
+    }
+  image->width = w;
+  image->height = h;
+  reindex_alpha(image);
+}
+
+
+struct orient_job
+{
+  const unsigned char *src;
+  unsigned char *dst;
+  int width, height, bytes, orientation;
+};
+
+static void orient_band(void *arg, int first, int end)
+{
+  struct orient_job *job = arg;
+  const int out_width = ORIENT_SWAPS_AXES(job->orientation)
+    ? job->height : job->width;
+
+  orient_rows(job->src + (size_t) job->bytes * job->width * first,
+	      job->bytes * job->width, job->width, job->height,
+	      first, end - first, job->dst, job->bytes * out_width,
+	      job->orientation, job->bytes);
+}
+
+// Turn IMAGE as ORIENTATION says, for readers that can't as they
+// decode.  A band of source rows lands in output columns no other band
+// writes, so the bands still run concurrently.
+static void orient_image(struct image *image, int orientation)
+{
+  struct orient_job job = {
+    image->rgb_data, NULL, image->width, image->height,
+    layout_channels[image->layout][0], orientation
+  };
+
+  if (orientation == ORIENT_NORMAL)
+    return;
+
+  job.dst = xmalloc((size_t) job.bytes * image->width * image->height);
+  band_run(image->height, orient_band, &job);
+  free_pixels(image);
+  image->rgb_data = job.dst;
+  if (image->alpha_data)
+    {
+      job.src = image->alpha_data;
+      job.bytes = 1;
+      job.dst = xmalloc((size_t) image->width * image->height);
+      band_run(image->height, orient_band, &job);
+      free(image->alpha_data);
+      image->alpha_data = job.dst;
+    }
+  if (ORIENT_SWAPS_AXES(orientation))
+    {
+      image->width = job.height;
+      image->height = job.width;
+    }
+  reindex_alpha(image);
+}
+
+
+// MIN_WIDTH and MIN_HEIGHT are the size the image will be resized to,
+// or zero to always read at full size.  The result may be smaller than
+// the original but is never smaller than that.  FRAME says how much of
+// the image is wanted, as for frame_window, and where the format
+// allows only that much is decoded.  LAYOUT is what
+// native_layout returned, and the image comes back in it if the reader
+// can decode to it, or else as RGB.  If LAYOUT is the A layout of that,
+// for an image whose alpha is wanted, an image with alpha comes back
+// with it in the pixels and one without in the X layout.  A JPEG is
+// turned upright by its EXIF, and any image is then turned as
+// ORIENTATION says.
+int read_image(const char *filename, struct image *image,
+	       int min_width, int min_height, int layout, int frame,
+	       int orientation)
+{
+  struct file_data file;
+  const unsigned char *data;
+  int success = 0, turned = 0, in_file = 0;
+
+  // Other readers frame the image as stored and it is turned after.
+  const int swap = ORIENT_SWAPS_AXES(orientation);
+  const int stored_width = swap ? min_height : min_width;
+  const int stored_height = swap ? min_width : min_height;
+
+  free_pixels(image);
+  free(image->palette);
+  image->palette = NULL;
+  free_alpha(image);
+
+  image->layout = LAYOUT_RGB;
+  image->premultiplied = 0;
+  if (!map_file(filename, &file))
+    return 0;
+  data = file.data;
+
+  switch (image_format(&file))
+    {
+    case FORMAT_PNG:
+      image->layout = layout;
+      success = read_png(data, file.size, filename,
+			 &image->width, &image->height,
+			 &image->rgb_data, &image->alpha_data, &image->spans,
+			 stored_width, stored_height, frame,
+			 &image->layout, &image->palette);
+      break;
+    case FORMAT_JPEG:
+      image->layout = layout;
+      success = read_jpeg(data, file.size, filename,
+			  &image->width, &image->height,
+			  &image->rgb_data, &image->alpha_data,
+			  min_width, min_height, frame, orientation,
+			  &image->layout);
+      turned = 1;
+      break;
+    case FORMAT_QOI:
+      image->layout = layout;
+      success = read_qoi(data, file.size, filename,
+			 &image->width, &image->height,
+			 &image->rgb_data, &image->alpha_data, &image->spans,
+			 &image->layout);
+      // These decode whole and are cut down afterwards.
+      if (success)
+	crop_frame(image, frame, stored_width, stored_height);
+      break;
+    case FORMAT_RAW:
+      image->layout = layout;
+      success = read_raw(data, file.size, filename,
+			 &image->width, &image->height,
+			 &image->rgb_data, &image->alpha_data, &image->spans,
+			 &image->layout, &image->premultiplied, &in_file);
+      // The pixels stay in the file, which has to stay mapped.
+      if (in_file)
 	{
-	  right--;
-	  mask >>= 1;
+	  image->file = xmalloc(sizeof(struct file_data));
+	  *image->file = file;
+	  file.data = NULL;
+	  file.mapped = 0;
 	}
+      if (success)
+	crop_frame(image, frame, stored_width, stored_height);
+      break;
     }
-  *left_shift = left;
-  *right_shift = right;
+  if (success)
+    {
+      if (!turned)
+	orient_image(image, orientation);
+      image->area = image->width * image->height;
+      image->stride = layout_channels[image->layout][0] * image->width;
+    }
+
+  unmap_file(&file);
+  return (success == 1);
 }
 
 
-Pixmap imageToPixmap(Display * dpy, struct image *image, int scr, Window win)
+// Like read_image, but only read the header and leave SOURCE to hand
+// out the rows, in the X layout LAYOUT where the reader can do that.
+// Returns a row source that must be closed, or NULL.
+struct row_source *open_image_rows(const char *filename,
+				   int min_width, int min_height, int layout)
 {
-  const int depth = DefaultDepth(dpy, scr);
-  Visual *visual = DefaultVisual(dpy, scr);
-  Colormap colormap = DefaultColormap(dpy, scr);
+  struct row_source *source = xcalloc(1, sizeof(struct row_source));
+  const unsigned char *data;
+  int success = 0;
 
-  int width = image->width, height = image->height, area = image->area;
-  Pixmap pixmap = XCreatePixmap(dpy, win, width, height, depth);
+  source->file = xmalloc(sizeof(struct file_data));
+  if (!map_file(filename, source->file))
+    {
+      free(source->file);
+      free(source);
+      return NULL;
+    }
+  data = source->file->data;
 
-  char *pixmap_data = NULL;
-  switch (depth)
+  switch (image_format(source->file))
     {
-    case 32:
-    case 24:
-      pixmap_data = xmalloc(4 * area);
+    case FORMAT_PNG:
+      success = open_png_rows(data, source->file->size, filename, source,
+			      layout);
       break;
-    case 16:
-    case 15:
-      pixmap_data = xmalloc(2 * area);
+    case FORMAT_JPEG:
+      success = open_jpeg_rows(data, source->file->size, filename, source,
+			       min_width, min_height, layout);
       break;
-    case 8:
-      pixmap_data = xmalloc(area);
+    case FORMAT_QOI:
+      success = open_qoi_rows(data, source->file->size, filename, source,
+			      layout);
       break;
-    default:
+    case FORMAT_RAW:
+      success = open_raw_rows(data, source->file->size, filename, source,
+			      layout);
       break;
     }
 
-  XImage *ximage = XCreateImage(dpy, visual, depth, ZPixmap, 0,
-				pixmap_data, width, height,
-				8, 0);
+  if (!success)
+    {
+      unmap_file(source->file);
+      free(source->file);
+      free(source);
+      return NULL;
+    }
+  return source;
+}
+
+
+void close_image_rows(struct row_source *source)
+{
+  if (!source)
+    return;
+  source->close(source);
+  unmap_file(source->file);
+  free(source->file);
+  free(source);
+}
+
+
+void free_image_buffers(struct image *image)
+{
+  free_pixels(image);
+  free(image->palette);
+  image->palette = NULL;
+  free_alpha(image);
+  image->layout = LAYOUT_RGB;
+}
+
+
+// Byte offset of an 8-bit channel MASK within a 32-bit pixel, or -1.
+static int mask_to_byte(unsigned long mask, int byte_order)
+{
+  for (int byte = 0; byte < 4; byte++)
+    if (mask == 0xffUL << 8 * byte)
+      return byte_order == LSBFirst ? byte : 3 - byte;
+  return -1;
+}
+
 
-  int entries;
-  XVisualInfo v_template;
-  v_template.visualid = XVisualIDFromVisual(visual);
-  XVisualInfo *visual_info = XGetVisualInfo(dpy, VisualIDMask,
-					    &v_template, &entries);
+// Find the LAYOUT_ matching the screen's pixels byte for byte, so a
+// reader can decode straight into XImage data.  Returns LAYOUT_RGB if
+// the visual isn't 32-bit TrueColor with 8-bit channels.
+int native_layout(Display *dpy, int scr)
+{
+  XVisualInfo v_template, *visual_info;
+  XPixmapFormatValues *formats;
+  int entries, bpp = 0, depth = DefaultDepth(dpy, scr);
+  int layout = LAYOUT_RGB;
 
-  unsigned char *rgb = image->rgb_data;
-  switch (visual_info->class)
+  if ((formats = XListPixmapFormats(dpy, &entries)))
     {
-    case PseudoColor:
-      {
-	XColor *colors;
-	int *closest_color;
+      for (int i = 0; i < entries; i++)
+	if (formats[i].depth == depth)
+	  bpp = formats[i].bits_per_pixel;
+      XFree(formats);
+    }
+  if (bpp != 32)
+    return LAYOUT_RGB;
 
-	colors = xmalloc(sizeof(XColor) * NUM_COLORS);
-	closest_color = xmalloc(sizeof(int) * NUM_COLORS);
+  v_template.visualid = XVisualIDFromVisual(DefaultVisual(dpy, scr));
+  if (!(visual_info = XGetVisualInfo(dpy, VisualIDMask, &v_template,
+				     &entries)))
+    return LAYOUT_RGB;
 
-	for (unsigned int i = 0; i < NUM_COLORS; i++)
-	  colors[i].pixel = i;
-	XQueryColors(dpy, colormap, colors, NUM_COLORS);
+  if (visual_info->class == TrueColor)
+    {
+      int order = ImageByteOrder(dpy);
+      int red = mask_to_byte(visual_info->red_mask, order);
+      int green = mask_to_byte(visual_info->green_mask, order);
+      int blue = mask_to_byte(visual_info->blue_mask, order);
+
+      for (int i = LAYOUT_RGBX; i <= LAYOUT_XBGR; i++)
+	if (layout_channels[i][1] == red && layout_channels[i][2] == green
+	    && layout_channels[i][3] == blue)
+	  layout = i;
+    }
 
-	for (int i = 0; i < NUM_COLORS; i++)
-	  {
-	    // find the closest color in the colormap
-	    double distance, distance_squared, min_distance = 0;
-	    for (int ii = 0; ii < NUM_COLORS; ii++)
-	      {
-		distance = colors[ii].red - ((i & 0xe0) << 8);
-		distance_squared = distance * distance;
-		distance = colors[ii].green - ((i & 0x1c) << 11);
-		distance_squared += distance * distance;
-		distance = colors[ii].blue - ((i & 0x03) << 14);
-		distance_squared += distance * distance;
-
-		if ((ii == 0) || (distance_squared < min_distance))
-		  {
-		    min_distance = distance_squared;
-		    closest_color[i] = ii;
-		  }
-	      }
-	  }
+  XFree(visual_info);
+  return layout;
+}
 
+
+struct compact_job
+{
+  const struct image *image;
+  XImage *ximage;
+  const struct converter *conv;	// NULL if COLORS are the pixels.
+  unsigned char colors[4 * 256];
+};
+
+static void compact_band(void *arg, int first, int end)
+{
+  struct compact_job *job = arg;
+  const struct image *image = job->image;
+  XImage *ximage = job->ximage;
+  unsigned char *rgb;
+
+  if (!job->conv)
+    {
+      for (int j = first; j < end; j++)
+	expand_row(image->rgb_data + (size_t) image->stride * j,
+		   job->colors, 4,
+		   (unsigned char *) ximage->data
+		   + (size_t) ximage->bytes_per_line * j, image->width);
+      return;
+    }
+
+  rgb = xmalloc((size_t) 3 * image->width * (end - first));
+  for (int j = first; j < end; j++)
+    expand_row(image->rgb_data + (size_t) image->stride * j, job->colors, 3,
+	       rgb + (size_t) 3 * image->width * (j - first), image->width);
+  convert_rows(job->conv, ximage, first, rgb, end - first);
+  free(rgb);
+}
+
+// A gray or indexed image has only 256 colors.  If the server has a
+// 32-bit LAYOUT they are worked out once and each pixel is a lookup;
+// otherwise rows are expanded to RGB a band at a time for CONV.
+static void compact_to_ximage(const struct converter *conv, int layout,
+			      const struct image *image, XImage *ximage)
+{
+  struct compact_job job;
+  unsigned char rgb[3 * 256];
+
+  job.image = image;
+  job.ximage = ximage;
+  compact_colors(image, rgb);
+  if (layout == LAYOUT_RGB)
+    {
+      job.conv = conv;
+      memcpy(job.colors, rgb, sizeof(rgb));
+    }
+  else
+    {
+      const unsigned char *channel = layout_channels[layout];
+
+      job.conv = NULL;
+      memset(job.colors, 255, sizeof(job.colors));
+      for (int i = 0; i < 256; i++)
+	for (int k = 0; k < 3; k++)
+	  job.colors[4 * i + channel[k + 1]] = rgb[3 * i + k];
+    }
+  band_run(image->height, compact_band, &job);
+}
+
+
+Pixmap imageToPixmap(Display * dpy, struct image *image, int scr, Window win,
+		     struct cache_entry *cache)
+{
+  const int depth = DefaultDepth(dpy, scr);
+  Visual *visual = DefaultVisual(dpy, scr);
+
+  int width = image->width, height = image->height;
+  Pixmap pixmap = XCreatePixmap(dpy, win, width, height, depth);
+  struct upload up;
+
+  // Already in the server's own pixel format.
+  if (image->layout != LAYOUT_RGB && !is_compact(image))
+    {
+      if (upload_create_shm(&up, dpy, scr, width, height))
 	for (int j = 0; j < height; j++)
-	  for (int i = 0; i < width; i++)
-	    {
-	      unsigned short pixel_ix;
-	      
-	      pixel_ix = (*rgb++ & 0xe0);
-	      pixel_ix |= (*rgb++ & 0xe0) >> 3;
-	      pixel_ix |= *rgb++ >> 6;
-	      
-	      XPutPixel(ximage, i, j, colors[closest_color[pixel_ix]].pixel);
-	  }
-	free(colors);
-	free(closest_color);
-      }
-      break;
-    case TrueColor:
-      {
-	unsigned char red_left_shift;
-	unsigned char red_right_shift;
-	unsigned char green_left_shift;
-	unsigned char green_right_shift;
-	unsigned char blue_left_shift;
-	unsigned char blue_right_shift;
-
-	computeShift(visual_info->red_mask, &red_left_shift,
-		     &red_right_shift);
-	computeShift(visual_info->green_mask, &green_left_shift,
-		     &green_right_shift);
-	computeShift(visual_info->blue_mask, &blue_left_shift,
-		     &blue_right_shift);
-
-	unsigned long pixel;
-	unsigned long red, green, blue;
-	for (int j = 0; j < height; j++)
-	  {
-	    for (int i = 0; i < width; i++)
-	      {
-		red = *rgb++ >> red_right_shift;
-		green = *rgb++ >> green_right_shift;
-		blue = *rgb++ >> blue_right_shift;
-
-		pixel = (((red << red_left_shift) & visual_info->red_mask)
-			 | ((green << green_left_shift)
-			    & visual_info->green_mask)
-			 | ((blue << blue_left_shift)
-			    & visual_info->blue_mask));
-
-		XPutPixel(ximage, i, j, pixel);
-	      }
-	  }
-      }
-      break;
-    default:
-      {
-	fprintf(stderr, "Unsupported visual for image\n");
-	return (pixmap);
-      }
+	  memcpy(up.ximage->data + j * up.ximage->bytes_per_line,
+		 image->rgb_data + (size_t) image->stride * j, 4 * width);
+      else
+	upload_wrap(&up, XCreateImage(dpy, visual, depth, ZPixmap, 0,
+				      (char *) image->rgb_data,
+				      width, height, 32, image->stride));
+    }
+  else
+    {
+      struct converter conv;
+      if (!converter_init(&conv, dpy, scr))
+	{
+	  fprintf(stderr, "Unsupported visual for image\n");
+	  return pixmap;
+	}
+
+      upload_create(&up, dpy, scr, width, height);
+      if (is_compact(image))
+	compact_to_ximage(&conv, native_layout(dpy, scr), image, up.ximage);
+      else
+	convert_image(&conv, up.ximage, image->rgb_data);
+      converter_free(&conv);
     }
 
   GC gc = XCreateGC(dpy, win, 0, NULL);
-  XPutImage(dpy, pixmap, gc, ximage, 0, 0, 0, 0, width, height);
+  upload_put(&up, dpy, pixmap, gc, 0, height);
   XFreeGC(dpy, gc);
-  XFree(visual_info);
-  free(pixmap_data);
-  // Set ximage data to NULL since pixmap data was deallocated above
-  ximage->data = NULL;
-  XDestroyImage(ximage);
+  if (cache)
+    cache_store(cache, up.ximage);
+  upload_destroy(&up, dpy);
 
   return (pixmap);
 }
 
 
-// Declare constants for a Bresenham stepper from (0,0) to (X,Y).
-// X and Y are assumed to be positive integers.
-#define BSTEP_DEFN_CONST(TAG, X, Y)                             \
-  int TAG##_y = (Y);                                            \
-  int TAG##_x = (X);                                            \
-  int TAG##_frac_slope = TAG##_y % TAG##_x;                     \
-  int TAG##_int_slope = (TAG##_y - TAG##_frac_slope) / TAG##_x; \
-  int TAG##_no_jump = 2 * TAG##_frac_slope;                     \
-  int TAG##_jump = TAG##_no_jump - 2 * TAG##_x;
-
-// Declare state variables for a given Bresenham stepper.
-#define BSTEP_INIT_STATE(TAG, OUT)		\
-  int OUT = 0;					\
-  int TAG##_##OUT##_err = TAG##_jump + TAG##_x;
+// Fetch the WIDTH x HEIGHT area of PIXMAP at X, Y into IMAGE, in the
+// server's 32-bit layout.  Returns 0 if the server has none.
+int imageFromPixmap(Display *dpy, Pixmap pixmap, int scr, int x, int y,
+		    int width, int height, struct image *image)
+{
+  int layout = native_layout(dpy, scr);
+  XImage *ximage;
+
+  free_image_buffers(image);
+  image->width = image->height = image->area = 0;
+  if (layout == LAYOUT_RGB || width <= 0 || height <= 0
+      || !(ximage = XGetImage(dpy, pixmap, x, y, width, height, AllPlanes,
+			      ZPixmap)))
+    return 0;
 
-// Compute next Bresenham step.
-#define BSTEP_NEXT(TAG, OUT)			\
-  if (TAG##_##OUT##_err > 0) {			\
-    OUT++;					\
-    TAG##_##OUT##_err += TAG##_jump;		\
-  }						\
-  else						\
-    TAG##_##OUT##_err += TAG##_no_jump;		\
-    OUT += TAG##_int_slope;
+  image->width = width;
+  image->height = height;
+  image->area = width * height;
+  image->layout = layout;
+  image->stride = image_stride(width, layout);
+  image->premultiplied = 0;
+  image->rgb_data = xmalloc((size_t) image->stride * height);
+  for (int j = 0; j < height; j++)
+    memcpy(image->rgb_data + (size_t) image->stride * j,
+	   ximage->data + (size_t) ximage->bytes_per_line * j, 4 * width);
+  XDestroyImage(ximage);
+  return 1;
+}
 
 
-void resize_background(struct image *image, const int w, const int h) 
+// FILTER is a FILTER_ value from resample.h.  The image keeps its
+// layout, except that palette indexes can only be picked, not blended.
+void resize_background(struct image *image, const int w, const int h,
+		       int filter)
 {
   int width = image->width;
   int height = image->height;
   if (width==w && height==h)
     return;
 
+  if (image->layout == LAYOUT_INDEXED && filter != FILTER_NEAREST)
+    expand_to_rgb(image);
+
   int new_area = w * h;
+  int stride = image_stride(w, image->layout);
 
   unsigned char *rgb_data = image->rgb_data;
-  unsigned char *new_rgb = (unsigned char *) xmalloc(3 * new_area);
-
-  unsigned char *rgb = new_rgb;
-
-  BSTEP_DEFN_CONST(JLOOP, h - 1, 256 * height - 256);
-  BSTEP_DEFN_CONST(ILOOP, w - 1, 256 * width - 256);
-
-  BSTEP_INIT_STATE(JLOOP, y);
-  for (int j = 0; j < h; j++)
-    {
-      BSTEP_INIT_STATE(ILOOP, x);
-      for (int i = 0; i < w; i++, rgb += 3)
-	{
-	  int ix0 = x >> 8;
-	  int t = x & 255;
-	  int ixb = (ix0 + 1 >= width) ? 0 : 3;
-
-	  int iy0 = y >> 8;
-	  int u = 255 - (y & 255);
-	  int iyb = (iy0 + 1 >= height) ? 0 : 3 * width;
-
-	  unsigned int weight[4];
-	  weight[1] = (t * u) >> 8;
-	  weight[0] = u - weight[1];
-	  weight[3] = t - weight[1];
-	  weight[2] = 255 + weight[1] - t - u;
-
-	  unsigned char *pixels[4];
-	  pixels[0] = rgb_data + 3 * (iy0 * width + ix0);
-	  pixels[1] = pixels[0] + ixb;
-	  pixels[2] = pixels[0] + iyb;
-	  pixels[3] = pixels[2] + ixb;
-
-	  for (int j = 0; j < 3; j++) {
-	    unsigned int sum = 0;
-
-	    for (int i = 0; i < 4; i++)
-	      sum += (unsigned int) (weight[i] * pixels[i][j]);
-	    rgb[j] = (sum + 255)>>8;
-	  }
+  unsigned char *new_rgb = (unsigned char *) xmalloc((size_t) stride * h);
 
-	  BSTEP_NEXT(ILOOP, x);
-	}
-      BSTEP_NEXT(JLOOP, y);
-    }
+  resample_image(rgb_data, width, height, image->stride, new_rgb, w, h,
+		 stride, layout_channels[image->layout][0], filter);
 
-  free(image->alpha_data);
-  image->alpha_data = NULL;
+  free_alpha(image);
 
-  free(rgb_data);
+  free_pixels(image);
   image->rgb_data = new_rgb;
+  image->stride = stride;
 
   image->width = w;
   image->height = h;
@@ -322,10 +650,123 @@ void resize_background(struct image *image, const int w, const int h)
 #define MAX(A,B) (A < B) ? B : A;
 #define MIN(A,B) (A > B) ? B : A;
 
+struct merge_job
+{
+  unsigned char *rowdst, *rowalpha;	// No ROWALPHA if alpha is in DST.
+  const unsigned char *rowsrc;
+  const unsigned char *channel, *panel_channel;
+  const unsigned char *palette;	// Set if the background is indexed.
+  int num_cols, dst_stride, alpha_stride, src_stride, premultiplied;
+  int alpha_at;			// Of the panel's pixels, or -1.
+  int direct;			// Whether the background is in the panel's order.
+  // The panel row and column of rowdst, for looking up spans.
+  const struct alpha_spans *spans;
+  int panel_row, panel_col;
+};
+
+// Columns FROM to TO of one row, all of alpha class KIND.  SCRATCH has
+// room for two rows of the panel's pixels.
+static void merge_span(const struct merge_job *job, unsigned char *dst,
+		       const unsigned char *alpha, const unsigned char *src,
+		       int from, int to, int kind, unsigned char *scratch)
+{
+  const unsigned char *channel = job->channel, *out = job->panel_channel;
+  const int src_bytes = channel[0], bytes = out[0], alpha_at = job->alpha_at;
+  const int n = bytes * (to - from);
+
+  if (kind == SPAN_OPAQUE)
+    return;
+
+  dst += bytes * from;
+  src += src_bytes * from;
+
+  // The blend kernels want the background in the panel's layout, and
+  // a clear run is just that, and opaque.
+  if (!job->direct || kind == SPAN_CLEAR)
+    {
+      unsigned char *gathered = kind == SPAN_CLEAR ? dst : scratch + n;
+
+      if (job->direct)
+	memcpy(gathered, src, n);
+      else
+	for (int i = 0; i < n; i += bytes, src += src_bytes)
+	  {
+	    const unsigned char *color =
+	      job->palette ? job->palette + 3 * *src : NULL;
+
+	    for (int k = 0; k < 3; k++)
+	      gathered[i + out[k + 1]] = color ? color[k] : src[channel[k + 1]];
+	    if (alpha_at >= 0)
+	      gathered[i + alpha_at] = 255;
+	  }
+      if (kind == SPAN_CLEAR)
+	{
+	  if (job->direct && alpha_at >= 0)
+	    for (int i = alpha_at; i < n; i += 4)
+	      dst[i] = 255;
+	  return;
+	}
+      src = gathered;
+    }
+
+  if (alpha_at >= 0)
+    {
+      blend_pixels(dst, src, to - from, alpha_at, job->premultiplied);
+      return;
+    }
+
+  // Alpha from a plane has to be spread over every byte.
+  alpha += from;
+  for (int i = 0; i < to - from; i++)
+    scratch[3 * i] = scratch[3 * i + 1] = scratch[3 * i + 2] = alpha[i];
+
+  blend_bytes(dst, scratch, src, n, job->premultiplied);
+}
+
+static void merge_band(void *arg, int first, int end)
+{
+  struct merge_job *job = arg;
+  const struct alpha_spans *spans = job->spans;
+  unsigned char *scratch = xmalloc(2 * job->panel_channel[0] * job->num_cols);
+
+  for (int row = first; row < end; row++)
+    {
+      unsigned char *dst = job->rowdst + (size_t) job->dst_stride * row;
+      const unsigned char *alpha = job->rowalpha
+	? job->rowalpha + (size_t) job->alpha_stride * row : NULL;
+      const unsigned char *src = job->rowsrc + (size_t) job->src_stride * row;
+
+      if (!spans)
+	{
+	  merge_span(job, dst, alpha, src, 0, job->num_cols, SPAN_PARTIAL,
+		     scratch);
+	  continue;
+	}
+
+      int panel_row = job->panel_row + row;
+
+      for (int i = spans->row[panel_row]; i < spans->row[panel_row + 1]; i++)
+	{
+	  int from = spans->span[i].start - job->panel_col;
+	  int to = spans->span[i].end - job->panel_col;
+
+	  from = MAX(0, from);
+	  to = MIN(job->num_cols, to);
+	  if (from < to)
+	    merge_span(job, dst, alpha, src, from, to, spans->span[i].kind,
+		       scratch);
+	}
+    }
+
+  free(scratch);
+}
+
+// The panel is RGB with an alpha plane, or in an A layout.  Blended
+// pixels of an A layout come out opaque.
 void merge_with_background(struct image *panel, struct image *background,
 			   int xoffset, int yoffset)
 {
-  if (panel->alpha_data)
+  if (image_has_alpha(panel))
     {
       int h_start = MAX(0, xoffset);
       int h_end = MIN(background->width, panel->width + xoffset);
@@ -335,126 +776,172 @@ void merge_with_background(struct image *panel, struct image *background,
       if (h_end <= h_start || v_end <= v_start)
 	return;
 
-      int num_cols = h_end - h_start;
-      int rows = v_end - v_start;
+      struct merge_job job;
+
+      // The background may still be in the server's pixel layout.
+      job.channel = layout_channels[background->layout];
+      job.panel_channel = layout_channels[panel->layout];
+      job.palette = background->layout == LAYOUT_INDEXED
+	? background->palette : NULL;
+      job.direct = !job.palette
+	&& !memcmp(job.channel, job.panel_channel, 4);
+      job.alpha_at = panel->alpha_data ? -1 : layout_alpha[panel->layout];
+      job.num_cols = h_end - h_start;
+      job.dst_stride = panel->stride;
+      job.alpha_stride = panel->width;
+      job.src_stride = background->stride;
+      job.premultiplied = panel->premultiplied;
+      job.spans = panel->spans;
+      job.panel_row = v_start - yoffset;
+      job.panel_col = h_start - xoffset;
+
+      job.rowdst = panel->rgb_data + (size_t) panel->stride * job.panel_row
+	+ job.panel_channel[0] * job.panel_col;
+      job.rowalpha = panel->alpha_data
+	? panel->alpha_data + (size_t) panel->width * job.panel_row
+	+ job.panel_col : NULL;
+      job.rowsrc = background->rgb_data
+	+ (size_t) background->stride * v_start + job.channel[0] * h_start;
+
+      band_run(v_end - v_start, merge_band, &job);
+    }
+}
 
-      int panel_start =
-	panel->width * (v_start - yoffset) + h_start - xoffset;
-      unsigned char *rowalpha =	panel->alpha_data + panel_start;
-      unsigned char *rowdst = panel->rgb_data + 3 * panel_start;
-      unsigned char *rowsrc =
-	background->rgb_data + 3 * (background->width * v_start + h_start);
 
-      while (rows--)
-	{
-	  unsigned char *dst = rowdst, *src = rowsrc, *alpha = rowalpha;
-	  int cols = num_cols;
-
-	  while (cols--)
-	    {
-	      for (int k = 3; k--; dst++)
-		*dst = (*dst * *alpha + *src++ * (255 - *alpha)) >> 8;
-	      alpha++;
-	    }
-
-	  rowdst += 3 * panel->width;
-	  rowalpha += panel->width;
-	  rowsrc += 3 * background->width;
-	}
+struct frame_job
+{
+  unsigned char *dst;
+  const unsigned char *src, *fill;
+  int stride, src_stride, bytes;
+  int h_start, h_end, v_start, v_end, xoffset, yoffset;
+};
+
+static void frame_band(void *arg, int first, int end)
+{
+  struct frame_job *job = arg;
+
+  for (int row = first; row < end; row++)
+    {
+      unsigned char *dst = job->dst + (size_t) job->stride * row;
+
+      memcpy(dst, job->fill, job->stride);
+      if (row >= job->v_start && row < job->v_end
+	  && job->h_end > job->h_start)
+	memcpy(dst + job->bytes * job->h_start,
+	       job->src + (size_t) job->src_stride * (row - job->yoffset)
+	       + job->bytes * (job->h_start - job->xoffset),
+	       job->bytes * (job->h_end - job->h_start));
     }
 }
 
-
+// The image is put at XOFFSET, YOFFSET on a WIDTH x HEIGHT field of
+// COLOR, in the image's layout.
 void frame_background(struct image *image,
 		      unsigned int width, unsigned int height,
 		      int xoffset, int yoffset, XftColor *color)
 {
+  const unsigned char *channel;
   int area = width * height;
-  unsigned char
-    r = color->color.red >> 8,
-    g = color->color.green >> 8,
-    b = color->color.blue >> 8;
-  unsigned char *new_rgb = xmalloc(3 * area);
-
-  unsigned char *dst = new_rgb;
-  for (int i = area; i--;)
-    {
-      *dst++ = r;
-      *dst++ = g;
-      *dst++ = b;
-    }
+  unsigned char *fill, pixel[4] = {255, 255, 255, 255};
+  struct frame_job job;
+
+  // The color may not be gray, let alone in the palette.
+  expand_to_rgb(image);
+  channel = layout_channels[image->layout];
+
+  pixel[channel[1]] = color->color.red >> 8;
+  pixel[channel[2]] = color->color.green >> 8;
+  pixel[channel[3]] = color->color.blue >> 8;
+
+  job.bytes = channel[0];
+  job.stride = image_stride(width, image->layout);
+  job.dst = xmalloc((size_t) job.stride * height);
+  job.src = image->rgb_data;
+  job.src_stride = image->stride;
+  job.xoffset = xoffset;
+  job.yoffset = yoffset;
+  job.h_start = MAX(0, xoffset);
+  job.h_end = MIN((int) width, image->width + xoffset);
+  job.v_start = MAX(0, yoffset);
+  job.v_end = MIN((int) height, image->height + yoffset);
+
+  // One row of plain color for every row to start from.
+  job.fill = fill = xcalloc(job.stride, 1);
+  for (int i = 0; i < width; i++)
+    memcpy(fill + job.bytes * i, pixel, job.bytes);
+
+  band_run(height, frame_band, &job);
+
+  free(fill);
+  free_pixels(image);
+  free_alpha(image);
+  image->rgb_data = job.dst;
+  image->stride = job.stride;
+  image->width = width;
+  image->height = height;
+  image->area = area;
+}
+
 
-  int h_start = MAX(0, xoffset);
-  int h_end = MIN(width, image->width + xoffset);
-  int v_start = MAX(0, yoffset);
-  int v_end = MIN(height, image->height + yoffset);
-  if (h_end > h_start && v_end > v_start)
+struct tile_job
+{
+  unsigned char *dst;
+  const unsigned char *src;
+  int width, stride, src_width, src_stride, src_height, bytes;
+  int col_start, row_start;
+};
+
+// Each row is the source row from COL_START to its end, then whole
+// copies of it, then its start again.
+static void tile_band(void *arg, int first, int end)
+{
+  struct tile_job *job = arg;
+  int row_bytes = job->bytes * job->src_width;
+  int line = job->bytes * job->width;
+
+  for (int i = first; i < end; i++)
     {
-      int cols = h_end - h_start;
-      int rows = v_end - v_start;
-      unsigned char *dst = new_rgb + 3 * (width * v_start + h_start);
-      unsigned char *src =
-	image->rgb_data + 3 * (image->width * (v_start - yoffset) +
-			       h_start - xoffset);
-
-      while (rows--)
+      const unsigned char *row = job->src + (size_t) job->src_stride
+	* ((job->row_start + i) % job->src_height);
+      unsigned char *dst = job->dst + (size_t) job->stride * i;
+      int done = row_bytes - job->bytes * job->col_start;
+
+      done = MIN(done, line);
+      memcpy(dst, row + job->bytes * job->col_start, done);
+      for (int n; done < line; done += n)
 	{
-	  memcpy(dst, src, 3*cols);
-	  dst += 3 * width;
-	  src += 3 * image->width;
+	  n = MIN(row_bytes, line - done);
+	  memcpy(dst + done, row, n);
 	}
     }
-
-  free(image->rgb_data);
-  free(image->alpha_data);
-  image->rgb_data = new_rgb;
-  image->width = width;
-  image->height = height;
-  image->area = area;
 }
 
-
 void tile_background(struct image *image, int width, int height,
 		     int xoffset, int yoffset)
 {
-  int col_start, row_num;
-
-  if ((col_start = -xoffset % image->width) < 0)
-    col_start += image->width;
-
-  if ((row_num = -yoffset % image->height) < 0)
-    row_num += image->height;
+  struct tile_job job;
 
-  unsigned char *new_rgb = xmalloc(3 * width * height);
+  if ((job.col_start = -xoffset % image->width) < 0)
+    job.col_start += image->width;
 
-  unsigned char *rgb = new_rgb;
-  unsigned char *row =  image->rgb_data + 3 * row_num * image->width;
-  unsigned char *image_end =
-    image->rgb_data + 3 * image->height * (image->width);
-  for (int i = height; i--;)
-    {
-      unsigned char *col = row + 3 * col_start;
-      unsigned char *row_end = row + 3 * image->width;
-
-      for (int j = width; j--;)
-	{
-	  *rgb++ = *col++;
-	  *rgb++ = *col++;
-	  *rgb++ = *col++;
+  if ((job.row_start = -yoffset % image->height) < 0)
+    job.row_start += image->height;
 
-	  if (col == row_end)
-	    col = row;
-	}
+  job.bytes = layout_channels[image->layout][0];
+  job.stride = image_stride(width, image->layout);
+  job.dst = xmalloc((size_t) job.stride * height);
+  job.src = image->rgb_data;
+  job.width = width;
+  job.src_width = image->width;
+  job.src_stride = image->stride;
+  job.src_height = image->height;
 
-      row += 3 * image->width;
-      if (row == image_end)
-	row = image->rgb_data;
-    }
+  band_run(height, tile_band, &job);
 
-  free(image->alpha_data);
-  image->alpha_data = NULL;
-  free(image->rgb_data);
-  image->rgb_data = new_rgb;
+  free_alpha(image);
+  free_pixels(image);
+  image->rgb_data = job.dst;
+  image->stride = job.stride;
   image->width = width;
   image->height = height;
   image->area = width * height;
@@ -1,16 +1,37 @@
 #ifndef _IMAGE_H_
 #define _IMAGE_H_
 
+struct alpha_spans;
+struct file_data;
+struct row_source;
+
 struct image
 {
   int height, width, area;
-  unsigned char *rgb_data, *alpha_data;
+  int layout;			// LAYOUT_ value from read.h.
+  int stride;			// Bytes from one row of rgb_data to the next.
+  unsigned char *rgb_data, *alpha_data;	// Alpha only for LAYOUT_RGB.
+  unsigned char *palette;	// 256 RGB entries for LAYOUT_INDEXED.
+  int premultiplied;		// Whether rgb_data is already scaled by alpha.
+  struct alpha_spans *spans;	// Index of alpha_data, if the reader made one.
+  struct file_data *file;	// Mapping rgb_data lies in, or NULL.
 };
 
-int read_image(const char *filename, struct image *image);
+int read_image(const char *filename, struct image *image,
+	       int min_width, int min_height, int layout, int frame,
+	       int orientation);
+int native_layout(Display *dpy, int scr);
+int image_has_alpha(const struct image *image);
+struct row_source *open_image_rows(const char *filename,
+				   int min_width, int min_height, int layout);
+void close_image_rows(struct row_source *source);
 void free_image_buffers(struct image *image);
-Pixmap imageToPixmap(Display *dpy, struct image *image, int scr, Window win);
-void resize_background(struct image *image, const int w, const int h);
+Pixmap imageToPixmap(Display *dpy, struct image *image, int scr, Window win,
+		     struct cache_entry *cache);
+int imageFromPixmap(Display *dpy, Pixmap pixmap, int scr, int x, int y,
+		    int width, int height, struct image *image);
+void resize_background(struct image *image, const int w, const int h,
+		       int filter);
 void merge_with_background(struct image *panel, struct image *background,
 			   int xoffset, int yoffset);
 void frame_background(struct image *image,
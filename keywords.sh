@@ -82,10 +82,21 @@ CENTER center c
 TRUE yes on true
 FALSE no off false
 
+# Counts which can be worked out at run time
+AUTO auto
+
 # Background styles
 COLOR color
 TILE tile
 STRETCH stretch
+FILL fill
+FIT fit
+
+# Resampling filters
+NEAREST nearest
+BILINEAR bilinear
+BOX box
+LANCZOS3 lanczos3 lanczos
 
 TOKEN_DESCRIPTIONS
 done
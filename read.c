@@ -25,21 +25,222 @@
 #include <jpeglib.h>
 #include <png.h>
 #include "read.h"
+#include "rotate.h"
 #include "util.h"
 
 
+const unsigned char layout_channels[NUM_LAYOUTS][4] = {
+  [LAYOUT_RGB] = {3, 0, 1, 2},
+  [LAYOUT_RGBX] = {4, 0, 1, 2},
+  [LAYOUT_BGRX] = {4, 2, 1, 0},
+  [LAYOUT_XRGB] = {4, 1, 2, 3},
+  [LAYOUT_XBGR] = {4, 3, 2, 1},
+  [LAYOUT_GRAY] = {1, 0, 0, 0},
+  [LAYOUT_INDEXED] = {1, 0, 0, 0},	// Only with the palette.
+  [LAYOUT_RGBA] = {4, 0, 1, 2},
+  [LAYOUT_BGRA] = {4, 2, 1, 0},
+  [LAYOUT_ARGB] = {4, 1, 2, 3},
+  [LAYOUT_ABGR] = {4, 3, 2, 1},
+};
+
+const signed char layout_alpha[NUM_LAYOUTS] = {
+  [LAYOUT_RGB] = -1,
+  [LAYOUT_RGBX] = 3,
+  [LAYOUT_BGRX] = 3,
+  [LAYOUT_XRGB] = 0,
+  [LAYOUT_XBGR] = 0,
+  [LAYOUT_GRAY] = -1,
+  [LAYOUT_INDEXED] = -1,
+  [LAYOUT_RGBA] = 3,
+  [LAYOUT_BGRA] = 3,
+  [LAYOUT_ARGB] = 0,
+  [LAYOUT_ABGR] = 0,
+};
+
+
+struct alpha_spans *alpha_spans_new(int height)
+{
+  struct alpha_spans *spans = xcalloc(1, sizeof(struct alpha_spans));
+
+  spans->row = xmalloc((height + 1) * sizeof(int));
+  spans->row[0] = 0;
+  spans->size = 2 * height;
+  spans->span = xmalloc(spans->size * sizeof(struct alpha_span));
+  return spans;
+}
+
+
+// Add the next row's runs, from alpha bytes STEP apart: 1 for a plane,
+// 4 for alpha in the pixels.  Neighbouring partial pixels go in one run
+// whatever their alpha, since they are all blended alike.
+void alpha_spans_add_row(struct alpha_spans *spans,
+			 const unsigned char *alpha, int width, int step)
+{
+  for (int start = 0, end; start < width; start = end)
+    {
+      int a = alpha[step * start];
+      int kind = a == 0 ? SPAN_CLEAR : a == 255 ? SPAN_OPAQUE : SPAN_PARTIAL;
+
+      for (end = start + 1; end < width; end++)
+	{
+	  a = alpha[step * end];
+	  if (kind == SPAN_CLEAR ? a != 0
+	      : kind == SPAN_OPAQUE ? a != 255
+	      : a == 0 || a == 255)
+	    break;
+	}
+
+      if (spans->count == spans->size)
+	{
+	  spans->size *= 2;
+	  spans->span = xrealloc(spans->span,
+				 spans->size * sizeof(struct alpha_span));
+	}
+      spans->span[spans->count].start = start;
+      spans->span[spans->count].end = end;
+      spans->span[spans->count].kind = kind;
+      spans->count++;
+    }
+  spans->row[++spans->rows] = spans->count;
+}
+
+
+void alpha_spans_free(struct alpha_spans *spans)
+{
+  if (!spans)
+    return;
+  free(spans->row);
+  free(spans->span);
+  free(spans);
+}
+
+
+// Feeds libpng from a file in memory.
+struct png_memory
+{
+  const unsigned char *data;
+  size_t size, pos;
+};
+
+static void png_read_memory(png_structp png_ptr, png_bytep out,
+			    png_size_t length)
+{
+  struct png_memory *memory = png_get_io_ptr(png_ptr);
+
+  if (length > memory->size - memory->pos)
+    png_error(png_ptr, "Read Error");
+  memcpy(out, memory->data + memory->pos, length);
+  memory->pos += length;
+}
+
+
+// Move the alpha out of W pixels of RGBA, packing the colour down to
+// RGB.  RGB may be RGBA itself, since each pixel only moves backwards.
+static void split_alpha_row(const unsigned char *rgba, unsigned char *rgb,
+			    unsigned char *alpha, int w)
+{
+  for (int j = 0; j < w; j++)
+    {
+      rgb[0] = rgba[0];
+      rgb[1] = rgba[1];
+      rgb[2] = rgba[2];
+      alpha[j] = rgba[3];
+      rgb += 3;
+      rgba += 4;
+    }
+}
+
+
+// The part of a WIDTH x HEIGHT image that FRAME keeps for a MIN_WIDTH
+// x MIN_HEIGHT screen, always at the middle.
+void frame_window(int frame, int width, int height,
+		  int min_width, int min_height,
+		  int *x, int *y, int *w, int *h)
+{
+  *w = width;
+  *h = height;
+  if (min_width > 0 && min_height > 0)
+    {
+      if (frame == FRAME_CENTER)
+	{
+	  if (*w > min_width)
+	    *w = min_width;
+	  if (*h > min_height)
+	    *h = min_height;
+	}
+      else if (frame == FRAME_FILL)
+	{
+	  // Trim whichever way the image is too long for the screen.
+	  if ((long long) width * min_height > (long long) height * min_width)
+	    *w = ((long long) height * min_width + min_height / 2)
+	      / min_height;
+	  else
+	    *h = ((long long) width * min_height + min_width / 2) / min_width;
+	  if (*w < 1)
+	    *w = 1;
+	  if (*h < 1)
+	    *h = 1;
+	}
+    }
+  *x = (width - *w) / 2;
+  *y = (height - *h) / 2;
+}
+
+
+// The largest size with the shape of WIDTH x HEIGHT that fits inside
+// MAX_WIDTH x MAX_HEIGHT, or the size itself if there is no limit.
+void fit_size(int width, int height, int max_width, int max_height,
+	      int *w, int *h)
+{
+  *w = width;
+  *h = height;
+  if (max_width <= 0 || max_height <= 0 || width <= 0 || height <= 0)
+    return;
+  if ((long long) width * max_height > (long long) height * max_width)
+    {
+      *w = max_width;
+      *h = ((long long) height * max_width + width / 2) / width;
+    }
+  else
+    {
+      *h = max_height;
+      *w = ((long long) width * max_height + height / 2) / height;
+    }
+  if (*w < 1)
+    *w = 1;
+  if (*h < 1)
+    *h = 1;
+}
+
+
+// If the image has alpha, SPANS is set to an index of it.  Rows are
+// decoded straight into *RGB unless FRAME leaves some of the image
+// out, since PNG can't scale.  Gray images, and palette ones without
+// transparency, come back in *LAYOUT as LAYOUT_GRAY or LAYOUT_INDEXED
+// with *PALETTE set.  Everything else comes back in the 32-bit *LAYOUT
+// asked for, with alpha in the pixels if that is an A layout and the
+// image has any, or dropped if it is an X layout; or as RGB with
+// *ALPHA set if the image has alpha.
 int
-read_png(FILE *infile, const char *filename, int *width, int *height,
-	 unsigned char **rgb, unsigned char **alpha)
+read_png(const unsigned char *data, size_t size, const char *filename,
+	 int *width, int *height, unsigned char **rgb, unsigned char **alpha,
+	 struct alpha_spans **spans, int min_width, int min_height, int frame,
+	 int *layout, unsigned char **palette)
 {
   int ret = 0;
+  struct png_memory memory = {data, size, 0};
 
   png_structp png_ptr;
   png_infop info_ptr;
   volatile png_bytepp row_pointers = NULL;
+  unsigned char *volatile scratch = NULL;
   png_uint_32 w, h;
-  int bit_depth, color_type, interlace_type;
+  int bit_depth, color_type, interlace_type, passes, x, y;
 
+  *rgb = NULL;
+  *alpha = NULL;
+  *spans = NULL;
+  *palette = NULL;
   if (!(png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
 					 (png_voidp) NULL,
 					 (png_error_ptr) NULL,
@@ -54,7 +255,7 @@ read_png(FILE *infile, const char *filename, int *width, int *height,
 #endif
     goto bugout;
 
-  png_init_io(png_ptr, infile);
+  png_set_read_fn(png_ptr, &memory, png_read_memory);
   png_read_info(png_ptr, info_ptr);
 
   if (!png_get_IHDR(png_ptr, info_ptr, &w, &h, &bit_depth, &color_type,
@@ -72,61 +273,188 @@ read_png(FILE *infile, const char *filename, int *width, int *height,
   *width = (int) w;
   *height = (int) h;
 
-  *alpha = NULL;
-  if (color_type == PNG_COLOR_TYPE_RGB_ALPHA
-      || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-    *alpha = xmalloc(*width * *height);
+  // Gray transparency was never honoured, so gray is always opaque.
+  if (color_type == PNG_COLOR_TYPE_GRAY)
+    {
+      png_set_expand_gray_1_2_4_to_8(png_ptr);
+      *layout = LAYOUT_GRAY;
+    }
+  else if (color_type == PNG_COLOR_TYPE_PALETTE
+	   && !png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+    {
+      png_colorp colors;
+      int count;
 
-  if (color_type == PNG_COLOR_TYPE_PALETTE && bit_depth <= 8)
+      if (!png_get_PLTE(png_ptr, info_ptr, &colors, &count))
+	goto bugout;
+      *palette = xcalloc(256, 3);
+      for (int i = 0; i < count && i < 256; i++)
+	{
+	  (*palette)[3 * i] = colors[i].red;
+	  (*palette)[3 * i + 1] = colors[i].green;
+	  (*palette)[3 * i + 2] = colors[i].blue;
+	}
+      *layout = LAYOUT_INDEXED;
+    }
+  else if (color_type == PNG_COLOR_TYPE_PALETTE)
     png_set_expand(png_ptr);
 
-  if (color_type == PNG_COLOR_TYPE_GRAY
-      || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+  if (color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
     png_set_gray_to_rgb(png_ptr);
 
+  if (layout_channels[*layout][0] == 4)
+    {
+      // A palette with transparency comes out with alpha too.
+      int has_alpha = (color_type & PNG_COLOR_MASK_ALPHA)
+	|| color_type == PNG_COLOR_TYPE_PALETTE;
+
+      if (layout_channels[*layout][1] >= 2)
+	png_set_bgr(png_ptr);
+      if (has_alpha && LAYOUT_HAS_ALPHA(*layout))
+	{
+	  if (layout_alpha[*layout] == 0)
+	    png_set_swap_alpha(png_ptr);
+	}
+      else
+	{
+	  if (has_alpha)
+	    png_set_strip_alpha(png_ptr);
+	  *layout = LAYOUT_WITHOUT_ALPHA(*layout);
+	  png_set_filler(png_ptr, 0xff, layout_alpha[*layout]
+			 ? PNG_FILLER_AFTER : PNG_FILLER_BEFORE);
+	}
+    }
+  else if (*layout != LAYOUT_GRAY && *layout != LAYOUT_INDEXED)
+    *layout = LAYOUT_RGB;
+
   if (bit_depth == 16)
     png_set_strip_16(png_ptr);
 
   png_set_packing(png_ptr);
+  passes = png_set_interlace_handling(png_ptr);
+  png_read_update_info(png_ptr, info_ptr);
 
-  row_pointers = xcalloc(*height, sizeof(png_bytep));
+  // Only RGB may come out with an alpha channel, to be split off.
+  int channels = png_get_channels(png_ptr, info_ptr);
+  if ((*layout == LAYOUT_RGB ? channels != 3 && channels != 4
+       : channels != layout_channels[*layout][0])
+      || png_get_rowbytes(png_ptr, info_ptr) != channels * w)
+    {
+      fprintf(stderr, "Unexpected pixel format in %s\n", filename);
+      goto bugout;
+    }
+  const int split = *layout == LAYOUT_RGB && channels == 4;
+  const int alpha_at = LAYOUT_HAS_ALPHA(*layout) ? layout_alpha[*layout] : -1;
 
-  for (int i = 0; i < *height; i++)
-    row_pointers[i] = xmalloc((*alpha ? 4 : 3) * *width);
+  frame_window(frame, w, h, min_width, min_height, &x, &y, width, height);
+  if (split || alpha_at >= 0)
+    *spans = alpha_spans_new(*height);
+  if (*width != w || *height != h)
+    {
+      // Rows below the window aren't decoded at all.  The rest pass
+      // through SCRATCH, which takes the whole image if it is
+      // interlaced, and only the window's columns are kept.
+      int keep = split ? 3 : channels;
 
-  png_read_image(png_ptr, row_pointers);
+      scratch = xmalloc((size_t) channels * w * (passes == 1 ? 1 : h));
+      *rgb = xmalloc(keep * *width * *height);
+      if (split)
+	*alpha = xmalloc(*width * *height);
+      if (passes > 1)
+	{
+	  row_pointers = xmalloc(h * sizeof(png_bytep));
+	  for (int i = 0; i < h; i++)
+	    row_pointers[i] = scratch + (size_t) channels * w * i;
+	  png_read_image(png_ptr, row_pointers);
+	}
+      for (int i = passes == 1 ? 0 : y; i < y + *height; i++)
+	{
+	  unsigned char *src = passes == 1 ? scratch : row_pointers[i];
+	  unsigned char *dst = *rgb + keep * *width * (i - y);
 
-  *rgb = xmalloc(3 * *width * *height);
+	  if (passes == 1)
+	    png_read_row(png_ptr, src, NULL);
+	  if (i < y)
+	    continue;
+	  src += channels * x;
+	  if (split)
+	    {
+	      unsigned char *alpha_row = *alpha + *width * (i - y);
 
-  unsigned char *ptr = *rgb;
-  unsigned char *alpha_ptr = *alpha;
-  if (*alpha == NULL)
-    for (int i = 0; i < *height; i++)
-      {
-	memcpy(ptr, row_pointers[i], 3 * *width);
-	ptr += 3 * *width;
-      }
-  else
-    for (int i = 0; i < *height; i++)
-      {
-	unsigned char *src = row_pointers[i];
+	      split_alpha_row(src, dst, alpha_row, *width);
+	      alpha_spans_add_row(*spans, alpha_row, *width, 1);
+	    }
+	  else
+	    {
+	      memcpy(dst, src, channels * *width);
+	      if (alpha_at >= 0)
+		alpha_spans_add_row(*spans, dst + alpha_at, *width, 4);
+	    }
+	}
+    }
+  else if (!split)
+    {
+      *rgb = xmalloc(channels * *width * *height);
+      while (passes--)
+	for (int i = 0; i < *height; i++)
+	  png_read_row(png_ptr, *rgb + channels * *width * i, NULL);
+      if (alpha_at >= 0)
+	for (int i = 0; i < *height; i++)
+	  alpha_spans_add_row(*spans, *rgb + 4 * *width * i + alpha_at,
+			      *width, 4);
+    }
+  else if (passes == 1)
+    {
+      // Each RGBA row goes where its RGB will end up and is split
+      // there at once, running a width's worth into the next row's
+      // place, or past the end for the last one.
+      *rgb = xmalloc(3 * *width * *height + *width);
+      *alpha = xmalloc(*width * *height);
+      for (int i = 0; i < *height; i++)
+	{
+	  unsigned char *row = *rgb + 3 * *width * i;
+	  unsigned char *alpha_row = *alpha + *width * i;
 
-	for (int j = *width; j--;)
-	  {
-	    *ptr++ = *src++;
-	    *ptr++ = *src++;
-	    *ptr++ = *src++;
-	    *alpha_ptr++ = *src++;
-	  }
-      }
+	  png_read_row(png_ptr, row, NULL);
+	  split_alpha_row(row, row, alpha_row, *width);
+	  alpha_spans_add_row(*spans, alpha_row, *width, 1);
+	}
+    }
+  else
+    {
+      // Interlaced rows aren't final until the last pass, so those get
+      // the full RGBA and are packed down afterwards.
+      *rgb = xmalloc(4 * *width * *height);
+      *alpha = xmalloc(*width * *height);
+      row_pointers = xmalloc(*height * sizeof(png_bytep));
+      for (int i = 0; i < *height; i++)
+	row_pointers[i] = *rgb + 4 * *width * i;
+      png_read_image(png_ptr, row_pointers);
+      for (int i = 0; i < *height; i++)
+	{
+	  split_alpha_row(row_pointers[i], *rgb + 3 * *width * i,
+			  *alpha + *width * i, *width);
+	  alpha_spans_add_row(*spans, *alpha + *width * i, *width, 1);
+	}
+      *rgb = xrealloc(*rgb, 3 * *width * *height);
+    }
 
   ret = 1;
 
  bugout:
-  if (row_pointers)
-    for (int i = 0; i < *height; i++)
-      free(row_pointers[i]);
   free(row_pointers);
+  free(scratch);
+  if (!ret)
+    {
+      free(*rgb);
+      *rgb = NULL;
+      free(*alpha);
+      *alpha = NULL;
+      alpha_spans_free(*spans);
+      *spans = NULL;
+      free(*palette);
+      *palette = NULL;
+    }
 
   png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp) NULL);
   return (ret);
@@ -140,14 +468,75 @@ void jpeg_panic_handler(j_common_ptr cinfo)
   longjmp(jpeg_panic, 1);
 }
 
+// Plain libjpeg only does 1/8, 1/4 and 1/2 and quietly maps other
+// ratios onto one of those, so check the dimensions it settles on.
+static void jpeg_scale_to(j_decompress_ptr cinfo, int min_width,
+			  int min_height)
+{
+  if (min_width <= 0 || min_height <= 0)
+    return;
+
+  cinfo->scale_denom = 8;
+  for (cinfo->scale_num = 1;; cinfo->scale_num++)
+    {
+      jpeg_calc_output_dimensions(cinfo);
+      if (cinfo->scale_num == 8
+	  || (cinfo->output_width >= min_width
+	      && cinfo->output_height >= min_height))
+	break;
+    }
+}
+
+// The orientation in the file's EXIF, kept by jpeg_save_markers.
+static int jpeg_orientation(j_decompress_ptr cinfo)
+{
+  for (jpeg_saved_marker_ptr marker = cinfo->marker_list; marker;
+       marker = marker->next)
+    if (marker->marker == JPEG_APP0 + 1)
+      return exif_orientation(marker->data, marker->data_length);
+  return ORIENT_NORMAL;
+}
+
+#ifdef JCS_EXTENSIONS
+// The color space libjpeg-turbo writes an X LAYOUT in.
+static J_COLOR_SPACE jpeg_color_space(int layout)
+{
+  static const J_COLOR_SPACE layout_color_space[] = {
+    JCS_RGB, JCS_EXT_RGBX, JCS_EXT_BGRX, JCS_EXT_XRGB, JCS_EXT_XBGR
+  };
+
+  return layout_color_space[layout];
+}
+#endif
+
+// libjpeg-turbo 1.5 can leave out whole iMCU columns and skip rows
+// without color converting them.
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) \
+  && LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+#define JPEG_CAN_CROP
+#endif
+
+// If MIN_WIDTH and MIN_HEIGHT are positive, the image is decoded at the
+// smallest DCT scale still covering them, so a large photo shrinks
+// during the IDCT instead of in resize_background.  FRAME_FIT only
+// needs to cover the fitted size, and FRAME_CENTER never scales.  The
+// image is turned as its EXIF says, and then by ORIENTATION, as the
+// rows come out of the decoder.  It is decoded straight into *LAYOUT,
+// or the X layout of an A one, when libjpeg-turbo can do that, and
+// otherwise *LAYOUT comes back as LAYOUT_RGB, or LAYOUT_GRAY for a gray
+// JPEG.
 int
-read_jpeg(FILE *infile, const char *filename, int *width, int *height,
-	  unsigned char **rgb, unsigned char **alpha)
+read_jpeg(const unsigned char *data, size_t size, const char *filename,
+	  int *width, int *height, unsigned char **rgb, unsigned char **alpha,
+	  int min_width, int min_height, int frame, int orientation,
+	  int *layout)
 {
   int ret = 0;
   struct jpeg_decompress_struct cinfo;
   struct jpeg_error_mgr jerr;
   volatile unsigned char *new_rgb = NULL;
+  unsigned char *volatile scratch = NULL;
+  int x, y, skip;
 
   *alpha = NULL;
 
@@ -160,8 +549,49 @@ read_jpeg(FILE *infile, const char *filename, int *width, int *height,
     }
 
   jpeg_create_decompress(&cinfo);
-  jpeg_stdio_src(&cinfo, infile);
+  jpeg_mem_src(&cinfo, (unsigned char *) data, size);
+  jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xffff);
   jpeg_read_header(&cinfo, TRUE);
+
+  // Scaling and framing work on the image as stored, so a turn across
+  // the axes swaps the screen round to match.
+  orientation = orient_then(jpeg_orientation(&cinfo), orientation);
+  if (ORIENT_SWAPS_AXES(orientation))
+    {
+      int swap = min_width;
+
+      min_width = min_height;
+      min_height = swap;
+    }
+
+  if (frame == FRAME_FIT)
+    {
+      int w, h;
+
+      fit_size(cinfo.image_width, cinfo.image_height, min_width, min_height,
+	       &w, &h);
+      jpeg_scale_to(&cinfo, w, h);
+    }
+  else if (frame != FRAME_CENTER)
+    jpeg_scale_to(&cinfo, min_width, min_height);
+
+  if (cinfo.jpeg_color_space == JCS_GRAYSCALE)
+    {
+      cinfo.out_color_space = JCS_GRAYSCALE;
+      *layout = LAYOUT_GRAY;
+    }
+#ifdef JCS_EXTENSIONS
+  else if (*layout != LAYOUT_RGB
+	   && (cinfo.jpeg_color_space == JCS_YCbCr
+	       || cinfo.jpeg_color_space == JCS_RGB))
+    {
+      *layout = LAYOUT_WITHOUT_ALPHA(*layout);
+      cinfo.out_color_space = jpeg_color_space(*layout);
+    }
+#endif
+  else
+    *layout = LAYOUT_RGB;
+
   jpeg_start_decompress(&cinfo);
 
   /* Prevent against integer overflow */
@@ -173,35 +603,847 @@ read_jpeg(FILE *infile, const char *filename, int *width, int *height,
       goto bugout;
     }
 
-  *width = cinfo.output_width;
-  *height = cinfo.output_height;
+  frame_window(frame, cinfo.output_width, cinfo.output_height,
+	       min_width, min_height, &x, &y, width, height);
+  skip = y;
 
-  new_rgb = xmalloc(3 * cinfo.output_width * cinfo.output_height);
+#ifdef JPEG_CAN_CROP
+  if (*width != cinfo.output_width)
+    {
+      // Widens the window out to whole iMCUs.  Keep a column either
+      // side, or smoothing the chroma up treats the edge as the
+      // picture's own.
+      JDIMENSION xoffset = x - (x > 0);
+      JDIMENSION columns = x + *width + (x + *width < cinfo.output_width)
+	- xoffset;
 
-  unsigned char *ptr = (unsigned char *)new_rgb;
-  if (cinfo.output_components == 3)
-    while (cinfo.output_scanline < cinfo.output_height)
-      {
-	jpeg_read_scanlines(&cinfo, &ptr, 1);
-	ptr += 3 * cinfo.output_width;
-      }
-  else if (cinfo.output_components == 1)
-    while (cinfo.output_scanline < cinfo.output_height)
+      jpeg_crop_scanline(&cinfo, &xoffset, &columns);
+      x -= xoffset;
+    }
+  if (skip)
+    skip -= jpeg_skip_scanlines(&cinfo, skip);
+#endif
+
+  // CMYK and YCCK come out with four components, which no layout has.
+  const int bytes = layout_channels[*layout][0];
+  if (cinfo.output_components != bytes)
+    {
+      fprintf(stderr, "Unsupported color space in image file %s\n",
+	      filename);
+      goto bugout;
+    }
+  new_rgb = xmalloc(bytes * *width * *height);
+
+  // Rows come straight into place unless columns have to be dropped,
+  // or the image turned.  That takes strips of rows, so it can go
+  // while they are still in cache rather than as a pass of its own.
+  if (orientation != ORIENT_NORMAL)
+    scratch = xmalloc((size_t) bytes * cinfo.output_width * ORIENT_TILE);
+  else if (*width != cinfo.output_width || skip)
+    scratch = xmalloc(bytes * cinfo.output_width);
+
+  unsigned char *ptr = (unsigned char *)new_rgb, *row = scratch;
+  while (skip-- > 0)
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  if (orientation != ORIENT_NORMAL)
+    for (int j = 0; j < *height; j += ORIENT_TILE)
       {
-	unsigned char *src = ptr + 2 * cinfo.output_width;
+	int rows = *height - j < ORIENT_TILE ? *height - j : ORIENT_TILE;
 
-	jpeg_read_scanlines(&cinfo, &src, 1);
-	for (int i = cinfo.output_width; i--; ptr += 3, src++)
-	  memset(ptr, *src, 3);
+	for (int i = 0; i < rows; i++)
+	  {
+	    row = scratch + (size_t) bytes * cinfo.output_width * i;
+	    jpeg_read_scanlines(&cinfo, &row, 1);
+	  }
+	orient_rows(scratch + bytes * x, bytes * cinfo.output_width,
+		    *width, *height, j, rows, ptr,
+		    bytes * (ORIENT_SWAPS_AXES(orientation) ? *height : *width),
+		    orientation, bytes);
       }
+  else
+    for (int j = 0; j < *height; j++, ptr += bytes * *width)
+      if (*width == cinfo.output_width)
+	jpeg_read_scanlines(&cinfo, &ptr, 1);
+      else
+	{
+	  jpeg_read_scanlines(&cinfo, &row, 1);
+	  memcpy(ptr, row + bytes * x, bytes * *width);
+	}
+
+  // Rows under the window are left undecoded, and
+  // jpeg_finish_decompress would insist on them.  Anywhere else it
+  // checks that every row wanted was read.
+  if (cinfo.output_scanline != y + *height
+      || cinfo.output_scanline == cinfo.output_height)
+    jpeg_finish_decompress(&cinfo);
+  if (ORIENT_SWAPS_AXES(orientation))
+    {
+      int swap = *width;
 
-  jpeg_finish_decompress(&cinfo);
+      *width = *height;
+      *height = swap;
+    }
   *rgb = (unsigned char *)new_rgb;
   ret = 1;
  
  bugout:
+  free(scratch);
 
   jpeg_destroy_decompress(&cinfo);
 
   return (ret);
 }
+
+
+// Row sources.  Each read_row call sets its own recovery point, since
+// the decoder state outlives the call that opened it.
+
+struct jpeg_rows
+{
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  unsigned char *image;		// All of it when turned, else NULL.
+  int bytes, next_row;
+};
+
+// Gray rows are spread over every byte of the source's pixels, which
+// leaves the spare byte of an X layout as good as any.
+static int jpeg_read_row(struct row_source *source, unsigned char *rgb)
+{
+  struct jpeg_rows *state = source->state;
+  j_decompress_ptr cinfo = &state->cinfo;
+  const int bytes = layout_channels[source->layout][0];
+
+  if (state->image)
+    {
+      const unsigned char *src = state->image
+	+ (size_t) state->bytes * source->width * state->next_row++;
+
+      if (state->bytes == bytes)
+	memcpy(rgb, src, bytes * source->width);
+      else
+	for (int i = source->width; i--; rgb += bytes, src++)
+	  memset(rgb, *src, bytes);
+      return 1;
+    }
+
+  if (setjmp(jpeg_panic))
+    return 0;
+
+  if (cinfo->output_components == bytes)
+    jpeg_read_scanlines(cinfo, &rgb, 1);
+  else
+    {
+      unsigned char *src = rgb + (bytes - 1) * cinfo->output_width;
+
+      jpeg_read_scanlines(cinfo, &src, 1);
+      for (int i = cinfo->output_width; i--; rgb += bytes, src++)
+	memset(rgb, *src, bytes);
+    }
+  return 1;
+}
+
+static void jpeg_close_rows(struct row_source *source)
+{
+  struct jpeg_rows *state = source->state;
+
+  // Skips jpeg_finish_decompress, which would insist on the rest of
+  // the scanlines being read.
+  jpeg_destroy_decompress(&state->cinfo);
+  free(state->image);
+  free(state);
+}
+
+// As read_jpeg, but leave the scanlines to be pulled one at a time,
+// in the X layout LAYOUT if libjpeg-turbo can do that and otherwise as
+// RGB.
+int
+open_jpeg_rows(const unsigned char *data, size_t size, const char *filename,
+	       struct row_source *source, int min_width, int min_height,
+	       int layout)
+{
+  struct jpeg_rows *state = xcalloc(1, sizeof(struct jpeg_rows));
+  j_decompress_ptr cinfo = &state->cinfo;
+
+  cinfo->err = jpeg_std_error(&state->jerr);
+  state->jerr.error_exit = jpeg_panic_handler;
+  if (setjmp(jpeg_panic))
+    goto bugout;
+
+  jpeg_create_decompress(cinfo);
+  jpeg_mem_src(cinfo, (unsigned char *) data, size);
+  jpeg_save_markers(cinfo, JPEG_APP0 + 1, 0xffff);
+  jpeg_read_header(cinfo, TRUE);
+
+  // A turned image has no first row until it is all decoded, so that
+  // is done here and the rows handed out afterwards.
+  if (jpeg_orientation(cinfo) != ORIENT_NORMAL)
+    {
+      unsigned char *alpha;
+
+      jpeg_destroy_decompress(cinfo);
+      if (!read_jpeg(data, size, filename, &source->width, &source->height,
+		     &state->image, &alpha, min_width, min_height,
+		     FRAME_WHOLE, ORIENT_NORMAL, &layout))
+	{
+	  free(state);
+	  return 0;
+	}
+      state->bytes = layout_channels[layout][0];
+      source->layout = layout == LAYOUT_GRAY ? LAYOUT_RGB : layout;
+      source->read_row = jpeg_read_row;
+      source->close = jpeg_close_rows;
+      source->state = state;
+      return 1;
+    }
+
+  jpeg_scale_to(cinfo, min_width, min_height);
+  source->layout = LAYOUT_RGB;
+#ifdef JCS_EXTENSIONS
+  if (layout != LAYOUT_RGB
+      && (cinfo->jpeg_color_space == JCS_YCbCr
+	  || cinfo->jpeg_color_space == JCS_RGB))
+    {
+      cinfo->out_color_space = jpeg_color_space(layout);
+      source->layout = layout;
+    }
+#endif
+  jpeg_start_decompress(cinfo);
+
+  if (cinfo->output_width >= MAX_DIMENSION
+      || cinfo->output_height >= MAX_DIMENSION)
+    {
+      fprintf(stderr, "Unreasonable dimension found in image file %s\n",
+	      filename);
+      goto bugout;
+    }
+  if (cinfo->output_components != layout_channels[source->layout][0]
+      && cinfo->output_components != 1)
+    {
+      fprintf(stderr, "Unsupported color space in image file %s\n",
+	      filename);
+      goto bugout;
+    }
+
+  source->width = cinfo->output_width;
+  source->height = cinfo->output_height;
+  source->read_row = jpeg_read_row;
+  source->close = jpeg_close_rows;
+  source->state = state;
+  return 1;
+
+ bugout:
+  jpeg_destroy_decompress(cinfo);
+  free(state);
+  return 0;
+}
+
+
+struct png_rows
+{
+  png_structp png_ptr;
+  png_infop info_ptr;
+  struct png_memory memory;
+  unsigned char *image;		// All of it when interlaced, else NULL.
+  int next_row;
+};
+
+static int png_read_rgb_row(struct row_source *source, unsigned char *rgb)
+{
+  struct png_rows *state = source->state;
+
+  if (state->image)
+    {
+      const size_t row = layout_channels[source->layout][0] * source->width;
+
+      memcpy(rgb, state->image + row * state->next_row++, row);
+      return 1;
+    }
+
+#if PNG_LIBPNG_VER_MAJOR>1 || (PNG_LIBPNG_VER_MAJOR==1 && PNG_LIBPNG_VER_MINOR>=4)
+  if (setjmp(png_jmpbuf((state->png_ptr))))
+#else
+  if (setjmp(state->png_ptr->jmpbuf))
+#endif
+    return 0;
+
+  png_read_row(state->png_ptr, rgb, NULL);
+  return 1;
+}
+
+static void free_png_rows(struct png_rows *state)
+{
+  png_destroy_read_struct(&state->png_ptr, &state->info_ptr,
+			  (png_infopp) NULL);
+  free(state->image);
+  free(state);
+}
+
+static void png_close_rows(struct row_source *source)
+{
+  free_png_rows(source->state);
+}
+
+// As read_png, but without alpha and leaving the rows to be pulled one
+// at a time, as RGB or in the X layout LAYOUT.  Interlaced images only
+// come complete, so those are read in full here and the rows handed
+// out from memory.
+int
+open_png_rows(const unsigned char *data, size_t size, const char *filename,
+	      struct row_source *source, int layout)
+{
+  struct png_rows *state = xcalloc(1, sizeof(struct png_rows));
+  volatile png_bytepp row_pointers = NULL;
+  png_uint_32 w, h;
+  int bit_depth, color_type, interlace_type, bytes;
+
+  if (!(state->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING,
+						(png_voidp) NULL,
+						(png_error_ptr) NULL,
+						(png_error_ptr) NULL))
+      || !(state->info_ptr = png_create_info_struct(state->png_ptr)))
+    out_of_memory();
+
+#if PNG_LIBPNG_VER_MAJOR>1 || (PNG_LIBPNG_VER_MAJOR==1 && PNG_LIBPNG_VER_MINOR>=4)
+  if (setjmp(png_jmpbuf((state->png_ptr))))
+#else
+  if (setjmp(state->png_ptr->jmpbuf))
+#endif
+    goto bugout;
+
+  state->memory.data = data;
+  state->memory.size = size;
+  png_set_read_fn(state->png_ptr, &state->memory, png_read_memory);
+  png_read_info(state->png_ptr, state->info_ptr);
+
+  if (!png_get_IHDR(state->png_ptr, state->info_ptr, &w, &h, &bit_depth,
+		    &color_type, &interlace_type, (int *) NULL, (int *) NULL))
+    goto bugout;
+
+  if (w >= MAX_DIMENSION || h >= MAX_DIMENSION)
+    {
+      fprintf(stderr, "Unreasonable dimension found in image file %s\n",
+	      filename);
+      goto bugout;
+    }
+
+  if (color_type == PNG_COLOR_TYPE_PALETTE && bit_depth <= 8)
+    png_set_expand(state->png_ptr);
+
+  if (color_type == PNG_COLOR_TYPE_GRAY
+      || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+    png_set_gray_to_rgb(state->png_ptr);
+
+  // Also drops transparency from tRNS chunks.
+  png_set_strip_alpha(state->png_ptr);
+
+  source->layout = LAYOUT_RGB;
+  if (layout_channels[layout][0] == 4)
+    {
+      source->layout = LAYOUT_WITHOUT_ALPHA(layout);
+      if (layout_channels[layout][1] >= 2)
+	png_set_bgr(state->png_ptr);
+      png_set_filler(state->png_ptr, 0xff, layout_alpha[layout]
+		     ? PNG_FILLER_AFTER : PNG_FILLER_BEFORE);
+    }
+  bytes = layout_channels[source->layout][0];
+
+  if (bit_depth == 16)
+    png_set_strip_16(state->png_ptr);
+
+  png_set_packing(state->png_ptr);
+  png_set_interlace_handling(state->png_ptr);
+  png_read_update_info(state->png_ptr, state->info_ptr);
+
+  if (png_get_rowbytes(state->png_ptr, state->info_ptr) != bytes * w)
+    {
+      fprintf(stderr, "Unsupported pixel format in image file %s\n",
+	      filename);
+      goto bugout;
+    }
+
+  if (interlace_type != PNG_INTERLACE_NONE)
+    {
+      state->image = xmalloc(bytes * w * h);
+      row_pointers = xmalloc(h * sizeof(png_bytep));
+      for (int i = 0; i < h; i++)
+	row_pointers[i] = state->image + bytes * w * i;
+      png_read_image(state->png_ptr, row_pointers);
+      free(row_pointers);
+    }
+
+  source->width = w;
+  source->height = h;
+  source->read_row = png_read_rgb_row;
+  source->close = png_close_rows;
+  source->state = state;
+  return 1;
+
+ bugout:
+  free(row_pointers);
+  free_png_rows(state);
+  return 0;
+}
+
+
+static unsigned int get_be32(const unsigned char *p)
+{
+  return (unsigned int) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+
+// QOI, from https://qoiformat.org: a 14-byte header, then a stream of
+// chunks each giving one pixel or a run of them, ending in 7 zeros and
+// a one.  It decodes several times faster than PNG at a similar size.
+
+#define QOI_HEADER_SIZE 14
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK 0xc0
+
+struct qoi_decoder
+{
+  const unsigned char *data, *end;
+  unsigned char index[64][4], px[4];
+  int run;
+};
+
+static int qoi_open(struct qoi_decoder *qoi, const unsigned char *data,
+		    size_t size, const char *filename, int *width,
+		    int *height, int *channels)
+{
+  unsigned int w, h;
+
+  if (size < QOI_HEADER_SIZE)
+    return 0;
+  w = get_be32(data + 4);
+  h = get_be32(data + 8);
+  if (w == 0 || h == 0 || w >= MAX_DIMENSION || h >= MAX_DIMENSION)
+    {
+      fprintf(stderr, "Unreasonable dimension found in image file %s\n",
+	      filename);
+      return 0;
+    }
+
+  if ((*channels = data[12]) != 3 && *channels != 4)
+    {
+      fprintf(stderr, "Unsupported pixel format in image file %s\n",
+	      filename);
+      return 0;
+    }
+
+  *width = w;
+  *height = h;
+  memset(qoi, 0, sizeof(*qoi));
+  qoi->data = data + QOI_HEADER_SIZE;
+  qoi->end = data + size;
+  qoi->px[3] = 255;
+  return 1;
+}
+
+// Decode the next WIDTH pixels into DST in LAYOUT, which is RGB or
+// 32-bit.  ALPHA may be NULL, and otherwise takes the alpha as a
+// plane.  Returns 0 if the data runs out first.
+static int qoi_decode_row(struct qoi_decoder *qoi, unsigned char *dst,
+			  int layout, unsigned char *alpha, int width)
+{
+  const unsigned char *data = qoi->data, *end = qoi->end;
+  const unsigned char *channel = layout_channels[layout];
+  const int spare = layout_alpha[layout];
+  const int keep_alpha = LAYOUT_HAS_ALPHA(layout);
+  unsigned char *px = qoi->px;
+  int run = qoi->run;
+
+  for (int i = 0; i < width; i++)
+    {
+      if (run > 0)
+	run--;
+      else
+	{
+	  int op;
+
+	  if (data >= end)
+	    return 0;
+	  op = *data++;
+	  if (end - data < (op == QOI_OP_RGB ? 3 : op == QOI_OP_RGBA ? 4
+			    : (op & QOI_MASK) == QOI_OP_LUMA))
+	    return 0;
+
+	  if (op == QOI_OP_RGB)
+	    {
+	      px[0] = data[0];
+	      px[1] = data[1];
+	      px[2] = data[2];
+	      data += 3;
+	    }
+	  else if (op == QOI_OP_RGBA)
+	    {
+	      memcpy(px, data, 4);
+	      data += 4;
+	    }
+	  else
+	    switch (op & QOI_MASK)
+	      {
+	      case QOI_OP_INDEX:
+		memcpy(px, qoi->index[op], 4);
+		break;
+	      case QOI_OP_DIFF:
+		px[0] += ((op >> 4) & 3) - 2;
+		px[1] += ((op >> 2) & 3) - 2;
+		px[2] += (op & 3) - 2;
+		break;
+	      case QOI_OP_LUMA:
+		{
+		  int green = (op & 0x3f) - 32;
+
+		  px[0] += green - 8 + (*data >> 4);
+		  px[1] += green;
+		  px[2] += green - 8 + (*data & 0x0f);
+		  data++;
+		}
+		break;
+	      case QOI_OP_RUN:
+		run = op & 0x3f;
+		break;
+	      }
+	  memcpy(qoi->index[(px[0] * 3 + px[1] * 5 + px[2] * 7
+			     + px[3] * 11) % 64], px, 4);
+	}
+
+      dst[channel[1]] = px[0];
+      dst[channel[2]] = px[1];
+      dst[channel[3]] = px[2];
+      if (spare >= 0)
+	dst[spare] = keep_alpha ? px[3] : 255;
+      dst += channel[0];
+      if (alpha)
+	alpha[i] = px[3];
+    }
+
+  qoi->data = data;
+  qoi->run = run;
+  return 1;
+}
+
+// As read_png for *LAYOUT, though QOI has no gray or palette images.
+int read_qoi(const unsigned char *data, size_t size, const char *filename,
+	     int *width, int *height, unsigned char **rgb,
+	     unsigned char **alpha, struct alpha_spans **spans, int *layout)
+{
+  struct qoi_decoder qoi;
+  int channels, bytes, alpha_at = -1;
+
+  *rgb = NULL;
+  *alpha = NULL;
+  *spans = NULL;
+  if (!qoi_open(&qoi, data, size, filename, width, height, &channels))
+    return 0;
+
+  if (layout_channels[*layout][0] != 4)
+    *layout = LAYOUT_RGB;
+  else if (channels == 4 && LAYOUT_HAS_ALPHA(*layout))
+    alpha_at = layout_alpha[*layout];
+  else
+    *layout = LAYOUT_WITHOUT_ALPHA(*layout);
+  bytes = layout_channels[*layout][0];
+
+  *rgb = xmalloc(bytes * *width * *height);
+  if (channels == 4 && (*layout == LAYOUT_RGB || alpha_at >= 0))
+    *spans = alpha_spans_new(*height);
+  if (channels == 4 && *layout == LAYOUT_RGB)
+    *alpha = xmalloc(*width * *height);
+
+  for (int i = 0; i < *height; i++)
+    {
+      unsigned char *row = *rgb + bytes * *width * i;
+      unsigned char *alpha_row = *alpha ? *alpha + *width * i : NULL;
+
+      if (!qoi_decode_row(&qoi, row, *layout, alpha_row, *width))
+	{
+	  fprintf(stderr, "Truncated image file %s\n", filename);
+	  free(*rgb);
+	  *rgb = NULL;
+	  free(*alpha);
+	  *alpha = NULL;
+	  alpha_spans_free(*spans);
+	  *spans = NULL;
+	  return 0;
+	}
+      if (alpha_row)
+	alpha_spans_add_row(*spans, alpha_row, *width, 1);
+      else if (alpha_at >= 0)
+	alpha_spans_add_row(*spans, row + alpha_at, *width, 4);
+    }
+  return 1;
+}
+
+static int qoi_read_row(struct row_source *source, unsigned char *rgb)
+{
+  return qoi_decode_row(source->state, rgb, source->layout, NULL,
+			source->width);
+}
+
+static void qoi_close_rows(struct row_source *source)
+{
+  free(source->state);
+}
+
+int open_qoi_rows(const unsigned char *data, size_t size,
+		  const char *filename, struct row_source *source,
+		  int layout)
+{
+  struct qoi_decoder *qoi = xmalloc(sizeof(struct qoi_decoder));
+  int channels;
+
+  if (!qoi_open(qoi, data, size, filename, &source->width, &source->height,
+		&channels))
+    {
+      free(qoi);
+      return 0;
+    }
+  source->layout = layout_channels[layout][0] == 4
+    ? LAYOUT_WITHOUT_ALPHA(layout) : LAYOUT_RGB;
+  source->read_row = qoi_read_row;
+  source->close = qoi_close_rows;
+  source->state = qoi;
+  return 1;
+}
+
+
+// Raw pixels, for themes that would rather spend disk than time.  A
+// 24-byte header:
+//
+//   "gleemraw"		magic
+//   width, height	32-bit big-endian
+//   format		32-bit big-endian RAW_ code below
+//   flags		32-bit big-endian RAW_ flags below
+//
+// then the rows of pixels in that format with no padding, then the
+// alpha plane if any, one byte per pixel.  Nothing needs decoding;
+// pixels the greeter can use as they are stay where they were mapped,
+// and others are repacked.  The codes are the file format's own and
+// never change, whatever becomes of the LAYOUT_ values.
+
+#define RAW_HEADER_SIZE 24
+#define RAW_ALPHA 1		// An alpha plane follows the pixels.
+#define RAW_PREMULTIPLIED 2	// The color is already scaled by alpha.
+
+// Formats, by the order of the bytes of a pixel.
+#define RAW_RGB24 1
+#define RAW_BGRX32 2
+#define RAW_XRGB32 3
+#define RAW_RGBX32 4
+#define RAW_XBGR32 5
+#define RAW_GRAY8 6
+// Alpha in the pixels, so with no plane.
+#define RAW_RGBA32 7
+#define RAW_BGRA32 8
+#define RAW_ARGB32 9
+#define RAW_ABGR32 10
+
+static const struct
+{
+  unsigned int format;
+  int layout;
+} raw_formats[] = {
+  {RAW_RGB24, LAYOUT_RGB},
+  {RAW_BGRX32, LAYOUT_BGRX},
+  {RAW_XRGB32, LAYOUT_XRGB},
+  {RAW_RGBX32, LAYOUT_RGBX},
+  {RAW_XBGR32, LAYOUT_XBGR},
+  {RAW_GRAY8, LAYOUT_GRAY},
+  {RAW_RGBA32, LAYOUT_RGBA},
+  {RAW_BGRA32, LAYOUT_BGRA},
+  {RAW_ARGB32, LAYOUT_ARGB},
+  {RAW_ABGR32, LAYOUT_ABGR},
+};
+
+static int raw_open(const unsigned char *data, size_t size,
+		    const char *filename, int *width, int *height,
+		    int *layout, int *flags)
+{
+  unsigned int w, h, format;
+  size_t pixels;
+
+  if (size < RAW_HEADER_SIZE)
+    return 0;
+  w = get_be32(data + 8);
+  h = get_be32(data + 12);
+  format = get_be32(data + 16);
+  *flags = get_be32(data + 20);
+  if (w == 0 || h == 0 || w >= MAX_DIMENSION || h >= MAX_DIMENSION)
+    {
+      fprintf(stderr, "Unreasonable dimension found in image file %s\n",
+	      filename);
+      return 0;
+    }
+  *layout = -1;
+  for (int i = 0; i < sizeof(raw_formats) / sizeof(raw_formats[0]); i++)
+    if (raw_formats[i].format == format)
+      *layout = raw_formats[i].layout;
+  if (*layout < 0 || (LAYOUT_HAS_ALPHA(*layout) && (*flags & RAW_ALPHA)))
+    {
+      fprintf(stderr, "Unsupported pixel format in image file %s\n",
+	      filename);
+      return 0;
+    }
+
+  pixels = (size_t) w * h;
+  if (size < RAW_HEADER_SIZE + pixels * layout_channels[*layout][0]
+      + (*flags & RAW_ALPHA ? pixels : 0))
+    {
+      fprintf(stderr, "Truncated image file %s\n", filename);
+      return 0;
+    }
+
+  *width = w;
+  *height = h;
+  return 1;
+}
+
+// Repack N pixels from STORED to LAYOUT, which is RGB or 32-bit.  An
+// A layout takes its alpha from the plane ALPHA if there is one, or
+// else from the stored pixels; an X layout's spare byte is opaque.
+static void raw_convert(const unsigned char *src, int stored,
+			const unsigned char *alpha, unsigned char *dst,
+			int layout, size_t n)
+{
+  const unsigned char *from = layout_channels[stored];
+  const unsigned char *to = layout_channels[layout];
+  const int spare = layout_alpha[layout];
+  const int stored_alpha = layout_alpha[stored];
+
+  if (stored == layout)
+    {
+      memcpy(dst, src, to[0] * n);
+      return;
+    }
+  for (size_t i = 0; i < n; i++, src += from[0], dst += to[0])
+    {
+      dst[to[1]] = src[from[1]];
+      dst[to[2]] = src[from[2]];
+      dst[to[3]] = src[from[3]];
+      if (spare < 0)
+	continue;
+      if (!LAYOUT_HAS_ALPHA(layout))
+	dst[spare] = 255;
+      else if (alpha)
+	dst[spare] = alpha[i];
+      else
+	dst[spare] = LAYOUT_HAS_ALPHA(stored) ? src[stored_alpha] : 255;
+    }
+}
+
+// As read_png for *LAYOUT, with gray kept as it is if it has no alpha,
+// and *PREMULTIPLIED set from the file if its alpha is kept.  Pixels
+// already in the layout that comes back aren't copied: *RGB points
+// into DATA, *IN_FILE is set, and DATA has to outlive the image.
+int read_raw(const unsigned char *data, size_t size, const char *filename,
+	     int *width, int *height, unsigned char **rgb,
+	     unsigned char **alpha, struct alpha_spans **spans, int *layout,
+	     int *premultiplied, int *in_file)
+{
+  int stored, flags, has_alpha;
+  const unsigned char *plane = NULL;
+  size_t pixels;
+
+  *alpha = NULL;
+  *spans = NULL;
+  *premultiplied = 0;
+  *in_file = 0;
+  if (!raw_open(data, size, filename, width, height, &stored, &flags))
+    return 0;
+
+  pixels = (size_t) *width * *height;
+  data += RAW_HEADER_SIZE;
+  if (flags & RAW_ALPHA)
+    plane = data + pixels * layout_channels[stored][0];
+  has_alpha = plane || LAYOUT_HAS_ALPHA(stored);
+
+  if (layout_channels[*layout][0] != 4)
+    *layout = LAYOUT_RGB;
+  else if (!has_alpha || !LAYOUT_HAS_ALPHA(*layout))
+    *layout = LAYOUT_WITHOUT_ALPHA(*layout);
+
+  // The rows are packed, as read_image leaves every image.
+  if (stored == *layout || (stored == LAYOUT_GRAY && !has_alpha))
+    {
+      *rgb = (unsigned char *) data;
+      *in_file = 1;
+      *layout = stored;
+    }
+  else
+    {
+      *rgb = xmalloc(pixels * layout_channels[*layout][0]);
+      raw_convert(data, stored, plane, *rgb, *layout, pixels);
+    }
+
+  if (has_alpha && *layout == LAYOUT_RGB)
+    {
+      *alpha = xmalloc(pixels);
+      if (plane)
+	memcpy(*alpha, plane, pixels);
+      else
+	for (size_t i = 0; i < pixels; i++)
+	  (*alpha)[i] = data[4 * i + layout_alpha[stored]];
+    }
+  if (*alpha || LAYOUT_HAS_ALPHA(*layout))
+    {
+      const int step = *alpha ? 1 : 4;
+      const unsigned char *at = *alpha ? *alpha : *rgb + layout_alpha[*layout];
+
+      *premultiplied = (flags & RAW_PREMULTIPLIED) != 0;
+      *spans = alpha_spans_new(*height);
+      for (int i = 0; i < *height; i++)
+	alpha_spans_add_row(*spans, at + (size_t) step * *width * i,
+			    *width, step);
+    }
+  return 1;
+}
+
+struct raw_rows
+{
+  const unsigned char *next;
+  int layout;
+};
+
+static int raw_read_row(struct row_source *source, unsigned char *rgb)
+{
+  struct raw_rows *state = source->state;
+
+  raw_convert(state->next, state->layout, NULL, rgb, source->layout,
+	      source->width);
+  state->next += layout_channels[state->layout][0] * source->width;
+  return 1;
+}
+
+static void raw_close_rows(struct row_source *source)
+{
+  free(source->state);
+}
+
+int open_raw_rows(const unsigned char *data, size_t size,
+		  const char *filename, struct row_source *source,
+		  int layout)
+{
+  struct raw_rows *state = xmalloc(sizeof(struct raw_rows));
+  int flags;
+
+  if (!raw_open(data, size, filename, &source->width, &source->height,
+		&state->layout, &flags))
+    {
+      free(state);
+      return 0;
+    }
+  state->next = data + RAW_HEADER_SIZE;
+  source->layout = layout_channels[layout][0] == 4
+    ? LAYOUT_WITHOUT_ALPHA(layout) : LAYOUT_RGB;
+  source->read_row = raw_read_row;
+  source->close = raw_close_rows;
+  source->state = state;
+  return 1;
+}
@@ -3,10 +3,131 @@
 
 #define MAX_DIMENSION 10000
 
-int read_jpeg(FILE *infile, const char *filename, int *width, int *height,
-          unsigned char **rgb, unsigned char **alpha);
+// Pixel layouts a reader can produce.  The X ones are 32-bit pixels
+// named by their byte order in memory.  Gray and indexed images, which
+// only come from files that are so already, keep one byte a pixel; the
+// indexes are into a palette of 256 RGB entries.  The A ones are the X
+// ones, in the same order, with alpha in the spare byte; an RGB image
+// keeps its alpha in a plane of its own.
+#define LAYOUT_RGB 0
+#define LAYOUT_RGBX 1
+#define LAYOUT_BGRX 2
+#define LAYOUT_XRGB 3
+#define LAYOUT_XBGR 4
+#define LAYOUT_GRAY 5
+#define LAYOUT_INDEXED 6
+#define LAYOUT_RGBA 7
+#define LAYOUT_BGRA 8
+#define LAYOUT_ARGB 9
+#define LAYOUT_ABGR 10
+#define NUM_LAYOUTS 11
 
-int read_png(FILE *infile, const char *filename, int *width, int *height,
-          unsigned char **rgb, unsigned char **alpha);
+#define LAYOUT_HAS_ALPHA(layout) ((layout) >= LAYOUT_RGBA)
+// Only for 32-bit layouts.
+#define LAYOUT_WITH_ALPHA(layout) \
+  (LAYOUT_HAS_ALPHA(layout) ? (layout) : (layout) + LAYOUT_RGBA - LAYOUT_RGBX)
+#define LAYOUT_WITHOUT_ALPHA(layout) \
+  (LAYOUT_HAS_ALPHA(layout) ? (layout) + LAYOUT_RGBX - LAYOUT_RGBA : (layout))
+
+// The bytes per pixel and the byte offsets of red, green and blue.
+extern const unsigned char layout_channels[NUM_LAYOUTS][4];
+// The byte offset of alpha, or of the spare byte in an X layout; -1 in
+// layouts without one.
+extern const signed char layout_alpha[NUM_LAYOUTS];
+
+struct file_data;
+
+// Runs of clear, opaque and partly transparent pixels along each row
+// of an alpha channel, so compositing need only blend the last kind.
+#define SPAN_CLEAR 0
+#define SPAN_OPAQUE 1
+#define SPAN_PARTIAL 2
+
+struct alpha_span
+{
+  int start, end, kind;
+};
+
+struct alpha_spans
+{
+  int *row;			// Row J is span[row[J]] up to span[row[J + 1]].
+  struct alpha_span *span;
+  int rows, count, size;
+};
+
+struct alpha_spans *alpha_spans_new(int height);
+void alpha_spans_add_row(struct alpha_spans *spans,
+			 const unsigned char *alpha, int width, int step);
+void alpha_spans_free(struct alpha_spans *spans);
+
+// How much of an image a reader decodes for a MIN_WIDTH x MIN_HEIGHT
+// screen.
+#define FRAME_WHOLE 0		// All of it.
+#define FRAME_CENTER 1		// The middle that fits, at full scale.
+#define FRAME_FILL 2		// The middle with the screen's shape.
+#define FRAME_FIT 3		// All of it, to be scaled to fit inside.
+
+void frame_window(int frame, int width, int height,
+		  int min_width, int min_height,
+		  int *x, int *y, int *w, int *h);
+void fit_size(int width, int height, int max_width, int max_height,
+	      int *w, int *h);
+
+// Readers decode from DATA, which holds the whole file.  Those taking
+// FRAME decode only the window frame_window gives.
+int read_jpeg(const unsigned char *data, size_t size, const char *filename,
+	      int *width, int *height,
+	      unsigned char **rgb, unsigned char **alpha,
+	      int min_width, int min_height, int frame, int orientation,
+	      int *layout);
+
+int read_png(const unsigned char *data, size_t size, const char *filename,
+	     int *width, int *height,
+	     unsigned char **rgb, unsigned char **alpha,
+	     struct alpha_spans **spans,
+	     int min_width, int min_height, int frame,
+	     int *layout, unsigned char **palette);
+
+int read_qoi(const unsigned char *data, size_t size, const char *filename,
+	     int *width, int *height,
+	     unsigned char **rgb, unsigned char **alpha,
+	     struct alpha_spans **spans, int *layout);
+
+int read_raw(const unsigned char *data, size_t size, const char *filename,
+	     int *width, int *height,
+	     unsigned char **rgb, unsigned char **alpha,
+	     struct alpha_spans **spans, int *layout, int *premultiplied,
+	     int *in_file);
+
+// A decoder handing out packed scanlines from the top down, so a
+// background can be scaled and uploaded without holding all of it.
+// The openers take the X layout the screen wants, or LAYOUT_RGB, and
+// set LAYOUT to that or to LAYOUT_RGB.  READ_ROW returns 0 if the
+// image turns out to be broken.
+struct row_source
+{
+  int width, height;
+  int (*read_row)(struct row_source *source, unsigned char *rgb);
+  void (*close)(struct row_source *source);
+  void *state;
+  struct file_data *file;	// Has to outlive STATE.
+  int layout;			// Of the rows READ_ROW gives.
+};
+
+int open_jpeg_rows(const unsigned char *data, size_t size,
+		   const char *filename, struct row_source *source,
+		   int min_width, int min_height, int layout);
+
+int open_png_rows(const unsigned char *data, size_t size,
+		  const char *filename, struct row_source *source,
+		  int layout);
+
+int open_qoi_rows(const unsigned char *data, size_t size,
+		  const char *filename, struct row_source *source,
+		  int layout);
+
+int open_raw_rows(const unsigned char *data, size_t size,
+		  const char *filename, struct row_source *source,
+		  int layout);
 
 #endif /* _READ_H_ */
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/Xft/Xft.h>
+#include <X11/extensions/Xrender.h>
+#include "cache.h"
+#include "image.h"
+#include "read.h"
+#include "render.h"
+#include "resample.h"
+#include "upload.h"
+#include "util.h"
+
+
+// Whether the screen takes 32-bit pixmaps stored a word a pixel, which
+// render_panel fills with ARGB.
+static int argb_pixmaps(Display *dpy, int scr)
+{
+  XPixmapFormatValues *formats;
+  int *depths, entries, found = 0;
+
+  if (!(depths = XListDepths(dpy, scr, &entries)))
+    return 0;
+  for (int i = 0; i < entries; i++)
+    if (depths[i] == 32)
+      found = 1;
+  XFree(depths);
+
+  if (found && (formats = XListPixmapFormats(dpy, &entries)))
+    {
+      found = 0;
+      for (int i = 0; i < entries; i++)
+	if (formats[i].depth == 32 && formats[i].bits_per_pixel == 32)
+	  found = 1;
+      XFree(formats);
+    }
+  return found;
+}
+
+
+// Whether the server can draw on the default visual with RENDER, has
+// picture filters and RepeatPad, which came in 0.6 and 0.10, and can
+// take the panel as ARGB.  Otherwise the work is done here.
+int render_usable(Display *dpy, int scr)
+{
+  int event, error, major, minor;
+
+  if (!XRenderQueryExtension(dpy, &event, &error)
+      || !XRenderQueryVersion(dpy, &major, &minor)
+      || (major == 0 && minor < 10))
+    return 0;
+  return XRenderFindVisualFormat(dpy, DefaultVisual(dpy, scr)) != NULL
+    && XRenderFindStandardFormat(dpy, PictStandardARGB32) != NULL
+    && argb_pixmaps(dpy, scr);
+}
+
+
+static const char *render_filter(int filter)
+{
+  switch (filter)
+    {
+    case FILTER_NEAREST:
+      return FilterNearest;
+    case FILTER_LANCZOS3:
+      return FilterBest;
+    default:
+      return FilterBilinear;
+    }
+}
+
+
+// A new W x H pixmap with SOURCE, which is WIDTH x HEIGHT, stretched
+// over it by the server.  The transform takes each destination pixel
+// center back to the source, and RepeatPad keeps the edges from
+// fading into nothing.
+Pixmap render_scale(Display *dpy, int scr, Drawable drawable, Pixmap source,
+		    int width, int height, int w, int h, int filter)
+{
+  XRenderPictFormat *format =
+    XRenderFindVisualFormat(dpy, DefaultVisual(dpy, scr));
+  XRenderPictureAttributes attributes;
+  XTransform transform = {{
+      {XDoubleToFixed((double) width / w), 0, 0},
+      {0, XDoubleToFixed((double) height / h), 0},
+      {0, 0, XDoubleToFixed(1)}
+    }};
+  Pixmap pixmap = XCreatePixmap(dpy, drawable, w, h, DefaultDepth(dpy, scr));
+  Picture src, dst;
+
+  attributes.repeat = RepeatPad;
+  src = XRenderCreatePicture(dpy, source, format, CPRepeat, &attributes);
+  dst = XRenderCreatePicture(dpy, pixmap, format, 0, NULL);
+  XRenderSetPictureTransform(dpy, src, &transform);
+  XRenderSetPictureFilter(dpy, src, render_filter(filter), NULL, 0);
+  XRenderComposite(dpy, PictOpSrc, src, None, dst, 0, 0, 0, 0, 0, 0, w, h);
+  XRenderFreePicture(dpy, src);
+  XRenderFreePicture(dpy, dst);
+  return pixmap;
+}
+
+
+// A pixmap of the area of BACKGROUND at X, Y with PANEL laid over it
+// by the server.  PANEL goes up once as premultiplied ARGB, so neither
+// the blend nor the background under the panel is needed here.  On a
+// cache miss the result is read back for CACHE, which is only the
+// size of the panel.
+Pixmap render_panel(Display *dpy, int scr, Window win, Pixmap background,
+		    int x, int y, const struct image *panel,
+		    struct cache_entry *cache)
+{
+  const int width = panel->width, height = panel->height;
+  Pixmap pixmap = XCreatePixmap(dpy, win, width, height,
+				DefaultDepth(dpy, scr));
+  Pixmap source = XCreatePixmap(dpy, win, width, height, 32);
+  GC gc = XCreateGC(dpy, pixmap, 0, NULL);
+  GC source_gc = XCreateGC(dpy, source, 0, NULL);
+  struct upload up;
+  XImage *ximage;
+  Picture src, dst;
+
+  upload_create_depth(&up, dpy, scr, 32, width, height);
+  // Byte offsets of alpha, red, green and blue.
+  const int msb = up.ximage->byte_order == MSBFirst;
+  const int at[4] = {msb ? 0 : 3, msb ? 1 : 2, msb ? 2 : 1, msb ? 3 : 0};
+  // The A layout that is ARGB32 as the server takes it.
+  const int argb = msb ? LAYOUT_ARGB : LAYOUT_BGRA;
+  const unsigned char *channel = layout_channels[panel->layout];
+  // Alpha is in a plane, or in the pixels.
+  const int step = panel->alpha_data ? 1 : 4;
+
+  for (int j = 0; j < height; j++)
+    {
+      const unsigned char *rgb = panel->rgb_data
+	+ (size_t) panel->stride * j;
+      const unsigned char *alpha = panel->alpha_data
+	? panel->alpha_data + (size_t) width * j
+	: rgb + layout_alpha[panel->layout];
+      unsigned char *out = (unsigned char *) up.ximage->data
+	+ (size_t) up.ximage->bytes_per_line * j;
+
+      if (panel->layout == argb && panel->premultiplied)
+	{
+	  memcpy(out, rgb, 4 * width);
+	  continue;
+	}
+      for (int i = 0; i < width; i++, rgb += channel[0], out += 4)
+	{
+	  unsigned int a = alpha[step * i];
+
+	  out[at[0]] = a;
+	  for (int k = 0; k < 3; k++)
+	    out[at[k + 1]] = panel->premultiplied ? rgb[channel[k + 1]]
+	      : (rgb[channel[k + 1]] * a + 127) / 255;
+	}
+    }
+  upload_put(&up, dpy, source, source_gc, 0, height);
+  upload_destroy(&up, dpy);
+
+  XCopyArea(dpy, background, pixmap, gc, x, y, width, height, 0, 0);
+  src = XRenderCreatePicture(dpy, source,
+			     XRenderFindStandardFormat(dpy,
+						       PictStandardARGB32),
+			     0, NULL);
+  dst = XRenderCreatePicture(dpy, pixmap,
+			     XRenderFindVisualFormat(dpy,
+						     DefaultVisual(dpy, scr)),
+			     0, NULL);
+  XRenderComposite(dpy, PictOpOver, src, None, dst, 0, 0, 0, 0, 0, 0,
+		   width, height);
+  XRenderFreePicture(dpy, src);
+  XRenderFreePicture(dpy, dst);
+  XFreeGC(dpy, source_gc);
+  XFreePixmap(dpy, source);
+
+  if (cache && cache->path
+      && (ximage = XGetImage(dpy, pixmap, 0, 0, width, height, AllPlanes,
+			     ZPixmap)))
+    {
+      cache_store(cache, ximage);
+      XDestroyImage(ximage);
+    }
+  XFreeGC(dpy, gc);
+  return pixmap;
+}
+
+
+// Upload IMAGE as it is and have the server scale it to W x H, which
+// saves resampling here and, when the image is the smaller, most of
+// the bytes on the wire.  Returns None when resize_background should
+// do it instead: the server can't, the image is already the size, or
+// it is so much bigger that a bilinear filter would alias.  Only
+// 32-bit servers qualify, so imageFromPixmap can fetch the pixels
+// under the panel back.
+Pixmap scaleToPixmap(Display *dpy, struct image *image, int scr, Window win,
+		     int w, int h, int filter)
+{
+  Pixmap source, pixmap;
+
+  if ((image->width == w && image->height == h)
+      || image->width >= 2 * w || image->height >= 2 * h
+      || native_layout(dpy, scr) == LAYOUT_RGB || !render_usable(dpy, scr))
+    return None;
+
+  source = imageToPixmap(dpy, image, scr, win, NULL);
+  pixmap = render_scale(dpy, scr, win, source, image->width, image->height,
+			w, h, filter);
+  XFreePixmap(dpy, source);
+  return pixmap;
+}
@@ -0,0 +1,14 @@
+// X11/extensions/render.h has taken _RENDER_H_.
+#ifndef _GLEEM_RENDER_H_
+#define _GLEEM_RENDER_H_
+
+int render_usable(Display *dpy, int scr);
+Pixmap render_scale(Display *dpy, int scr, Drawable drawable, Pixmap source,
+		    int width, int height, int w, int h, int filter);
+Pixmap render_panel(Display *dpy, int scr, Window win, Pixmap background,
+		    int x, int y, const struct image *panel,
+		    struct cache_entry *cache);
+Pixmap scaleToPixmap(Display *dpy, struct image *image, int scr, Window win,
+		     int w, int h, int filter);
+
+#endif /* _GLEEM_RENDER_H_ */
@@ -0,0 +1,1754 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include "band.h"
+#include "read.h"
+#include "resample.h"
+#include "simd.h"
+#include "util.h"
+
+// Declare constants for a Bresenham stepper from (0,0) to (X,Y).
+// X and Y are assumed to be positive integers.
+#define BSTEP_DEFN_CONST(TAG, X, Y)                             \
+  int TAG##_y = (Y);                                            \
+  int TAG##_x = (X);                                            \
+  int TAG##_frac_slope = TAG##_y % TAG##_x;                     \
+  int TAG##_int_slope = (TAG##_y - TAG##_frac_slope) / TAG##_x; \
+  int TAG##_no_jump = 2 * TAG##_frac_slope;                     \
+  int TAG##_jump = TAG##_no_jump - 2 * TAG##_x;
+
+// Declare state variables for a given Bresenham stepper.
+#define BSTEP_INIT_STATE(TAG, OUT)		\
+  int OUT = 0;					\
+  int TAG##_##OUT##_err = TAG##_jump + TAG##_x;
+
+// Compute next Bresenham step.
+#define BSTEP_NEXT(TAG, OUT)			\
+  do {						\
+    if (TAG##_##OUT##_err > 0) {		\
+      OUT++;					\
+      TAG##_##OUT##_err += TAG##_jump;		\
+    }						\
+    else {					\
+      TAG##_##OUT##_err += TAG##_no_jump;	\
+    }						\
+    OUT += TAG##_int_slope;			\
+  } while (0)
+
+
+// Where one output row or column samples the source: the nearer
+// source pixel and the step to its neighbour, which is zero at the far
+// edge.  Columns count in bytes and rows in rows.  The 8-bit weights
+// are kept apart; columns weight the right neighbour and rows the upper
+// pixel.
+struct bilinear_tap
+{
+  int offset, step;
+};
+
+struct bilinear_map
+{
+  int w, h, row_bytes;		// ROW_BYTES is the source stride.
+  int bytes;			// Per pixel, 3 or 4.
+  int safe;			// Leading columns a vector kernel may do.
+  struct bilinear_tap *columns, *rows;
+  unsigned short *column_weight, *row_weight;
+};
+
+// Output row from the two source rows it falls between, TOP weighted
+// by U.  TOP and BOTTOM are the same row at the bottom edge.
+typedef void (*bilinear_row_fn)(const unsigned char *top,
+				const unsigned char *bottom, unsigned int u,
+				const struct bilinear_map *map,
+				unsigned char *dst);
+
+
+// Step 256 * (SIZE - 1) across N samples in 8.8 fixed point.
+static void bilinear_axis(int size, int n, int pixel_stride,
+			  struct bilinear_tap *taps, unsigned short *weights,
+			  int invert)
+{
+  if (n == 1)
+    {
+      taps[0].offset = 0;
+      taps[0].step = size > 1 ? pixel_stride : 0;
+      weights[0] = invert ? 255 : 0;
+      return;
+    }
+
+  BSTEP_DEFN_CONST(AXIS, n - 1, 256 * size - 256);
+  BSTEP_INIT_STATE(AXIS, pos);
+  for (int i = 0; i < n; i++)
+    {
+      int ix = pos >> 8;
+
+      taps[i].offset = ix * pixel_stride;
+      taps[i].step = (ix + 1 >= size) ? 0 : pixel_stride;
+      weights[i] = invert ? 255 - (pos & 255) : pos & 255;
+      BSTEP_NEXT(AXIS, pos);
+    }
+}
+
+
+// Columns FROM up to W of row J.  This is the reference the vector
+// kernels must match byte for byte, and they use it for leftovers.
+static inline void bilinear_span_bytes(const unsigned char *top,
+				       const unsigned char *bottom,
+				       unsigned int u,
+				       const struct bilinear_map *map,
+				       int from, unsigned char *dst,
+				       const int bytes)
+{
+  for (int i = from; i < map->w; i++, dst += bytes)
+    {
+      const struct bilinear_tap *col = &map->columns[i];
+      unsigned int t = map->column_weight[i];
+
+      unsigned int weight[4];
+      weight[1] = (t * u) >> 8;
+      weight[0] = u - weight[1];
+      weight[3] = t - weight[1];
+      weight[2] = 255 + weight[1] - t - u;
+
+      const unsigned char *pixels[4];
+      pixels[0] = top + col->offset;
+      pixels[1] = pixels[0] + col->step;
+      pixels[2] = bottom + col->offset;
+      pixels[3] = pixels[2] + col->step;
+
+      for (int k = 0; k < bytes; k++)
+	{
+	  unsigned int sum = 0;
+
+	  for (int n = 0; n < 4; n++)
+	    sum += weight[n] * pixels[n][k];
+	  dst[k] = (sum + 255) >> 8;
+	}
+    }
+}
+
+// Constant pixel sizes let the compiler unroll the channels.
+static void bilinear_span_scalar(const unsigned char *top,
+				 const unsigned char *bottom, unsigned int u,
+				 const struct bilinear_map *map, int from,
+				 unsigned char *dst)
+{
+  if (map->bytes == 4)
+    bilinear_span_bytes(top, bottom, u, map, from, dst, 4);
+  else if (map->bytes == 3)
+    bilinear_span_bytes(top, bottom, u, map, from, dst, 3);
+  else
+    bilinear_span_bytes(top, bottom, u, map, from, dst, 1);
+}
+
+static void bilinear_row_scalar(const unsigned char *top,
+				const unsigned char *bottom, unsigned int u,
+				const struct bilinear_map *map,
+				unsigned char *dst)
+{
+  bilinear_span_scalar(top, bottom, u, map, 0, dst);
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+// The vector kernels load each source pixel together with its right
+// neighbour as one 8-byte read.  That is only right where the column
+// step is 3, but where it is 0 the column weight is 0 as well.  The
+// reads stay within the row, which map->safe sees to.
+
+// Per pixel and row, w0 * left + w1 * right for each channel.  Signed
+// 16 x 16 bit products reproduce the scalar wraparound exactly, since
+// a bottom weight can go negative when the sample falls on a row.
+TARGET_SSE2
+static inline __m128i bilinear_pair_sse2(const unsigned char *pixel,
+					 __m128i weights)
+{
+  __m128i lanes = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)
+						    pixel),
+				    _mm_setzero_si128());
+  // Interleave left and right channels: lr lr lr, then junk.
+  lanes = _mm_unpacklo_epi16(lanes, _mm_srli_si128(lanes, 6));
+  return _mm_madd_epi16(lanes, weights);
+}
+
+TARGET_SSE2
+static inline __m128i bilinear_pixel_sse2(const unsigned char *top,
+					  const unsigned char *bottom,
+					  __m128i top_weights,
+					  __m128i bottom_weights)
+{
+  __m128i sum = _mm_add_epi32(bilinear_pair_sse2(top, top_weights),
+			      bilinear_pair_sse2(bottom, bottom_weights));
+  return _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(255)), 8);
+}
+
+// Weights for four columns of the row with upper weight U, as 32-bit
+// lanes of (w0, w1) and (w2, w3) pairs.
+TARGET_SSE2
+static inline void bilinear_weights_sse2(__m128i t, __m128i u,
+					 __m128i *top, __m128i *bottom)
+{
+  __m128i w1 = _mm_srli_epi16(_mm_mullo_epi16(t, u), 8);
+  __m128i w0 = _mm_sub_epi16(u, w1);
+  __m128i w3 = _mm_sub_epi16(t, w1);
+  __m128i w2 = _mm_sub_epi16(_mm_add_epi16(_mm_set1_epi16(255), w1),
+			     _mm_add_epi16(t, u));
+  *top = _mm_unpacklo_epi16(w0, w1);
+  *bottom = _mm_unpacklo_epi16(w2, w3);
+}
+
+static inline void store_rgb(unsigned char *dst, unsigned int pixel)
+{
+  memcpy(dst, &pixel, 3);
+}
+
+TARGET_SSE2
+static void bilinear_row_sse2(const unsigned char *top,
+			      const unsigned char *bottom, unsigned int u,
+			      const struct bilinear_map *map,
+			      unsigned char *dst)
+{
+  const __m128i u16 = _mm_set1_epi16(u);
+  int i;
+
+  for (i = 0; i + 4 <= map->safe; i += 4, dst += 12)
+    {
+      const struct bilinear_tap *c = &map->columns[i];
+      __m128i top_w, bottom_w, p0, p1, p2, p3;
+
+      bilinear_weights_sse2(_mm_loadl_epi64((const __m128i *)
+					    &map->column_weight[i]),
+			    u16, &top_w, &bottom_w);
+#define PIXEL(K, IMM)							\
+      bilinear_pixel_sse2(top + c[K].offset, bottom + c[K].offset,	\
+			  _mm_shuffle_epi32(top_w, IMM),		\
+			  _mm_shuffle_epi32(bottom_w, IMM))
+      p0 = PIXEL(0, 0x00);
+      p1 = PIXEL(1, 0x55);
+      p2 = PIXEL(2, 0xaa);
+      p3 = PIXEL(3, 0xff);
+#undef PIXEL
+
+      __m128i bytes = _mm_packus_epi16(_mm_packs_epi32(p0, p1),
+				       _mm_packs_epi32(p2, p3));
+      store_rgb(dst, _mm_cvtsi128_si32(bytes));
+      store_rgb(dst + 3, _mm_cvtsi128_si32(_mm_srli_si128(bytes, 4)));
+      store_rgb(dst + 6, _mm_cvtsi128_si32(_mm_srli_si128(bytes, 8)));
+      store_rgb(dst + 9, _mm_cvtsi128_si32(_mm_srli_si128(bytes, 12)));
+    }
+
+  bilinear_span_scalar(top, bottom, u, map, i, dst);
+}
+
+// Four-byte pixels need no interleaving beyond the pair itself, and
+// four of them fill a register exactly.
+TARGET_SSE2
+static inline __m128i bilinear_pair32_sse2(const unsigned char *pixel,
+					   __m128i weights)
+{
+  __m128i lanes = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)
+						    pixel),
+				    _mm_setzero_si128());
+  lanes = _mm_unpacklo_epi16(lanes, _mm_srli_si128(lanes, 8));
+  return _mm_madd_epi16(lanes, weights);
+}
+
+TARGET_SSE2
+static inline __m128i bilinear_pixel32_sse2(const unsigned char *top,
+					    const unsigned char *bottom,
+					    __m128i top_weights,
+					    __m128i bottom_weights)
+{
+  __m128i sum = _mm_add_epi32(bilinear_pair32_sse2(top, top_weights),
+			      bilinear_pair32_sse2(bottom, bottom_weights));
+  return _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(255)), 8);
+}
+
+TARGET_SSE2
+static void bilinear_row32_sse2(const unsigned char *top,
+				const unsigned char *bottom, unsigned int u,
+				const struct bilinear_map *map,
+				unsigned char *dst)
+{
+  const __m128i u16 = _mm_set1_epi16(u);
+  int i;
+
+  for (i = 0; i + 4 <= map->safe; i += 4, dst += 16)
+    {
+      const struct bilinear_tap *c = &map->columns[i];
+      __m128i top_w, bottom_w, p0, p1, p2, p3;
+
+      bilinear_weights_sse2(_mm_loadl_epi64((const __m128i *)
+					    &map->column_weight[i]),
+			    u16, &top_w, &bottom_w);
+#define PIXEL(K, IMM)							\
+      bilinear_pixel32_sse2(top + c[K].offset, bottom + c[K].offset,	\
+			    _mm_shuffle_epi32(top_w, IMM),		\
+			    _mm_shuffle_epi32(bottom_w, IMM))
+      p0 = PIXEL(0, 0x00);
+      p1 = PIXEL(1, 0x55);
+      p2 = PIXEL(2, 0xaa);
+      p3 = PIXEL(3, 0xff);
+#undef PIXEL
+
+      _mm_storeu_si128((__m128i *) dst,
+		       _mm_packus_epi16(_mm_packs_epi32(p0, p1),
+					_mm_packs_epi32(p2, p3)));
+    }
+
+  bilinear_span_scalar(top, bottom, u, map, i, dst);
+}
+
+// As above, but the upper and lower source rows share one register
+// and a byte shuffle does the interleaving.
+TARGET_AVX2
+static inline __m128i bilinear_pixel_avx2(const unsigned char *top,
+					  const unsigned char *bottom,
+					  __m256i weights)
+{
+  const __m128i interleave =
+    _mm_setr_epi8(0, 3, 1, 4, 2, 5, -1, -1, 8, 11, 9, 12, 10, 13, -1, -1);
+  __m128i bytes =
+    _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *) top),
+		       _mm_loadl_epi64((const __m128i *) bottom));
+  __m256i sums =
+    _mm256_madd_epi16(_mm256_cvtepu8_epi16(_mm_shuffle_epi8(bytes,
+							      interleave)),
+		      weights);
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(sums),
+			      _mm256_extracti128_si256(sums, 1));
+  return _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(255)), 8);
+}
+
+TARGET_AVX2
+static void bilinear_row_avx2(const unsigned char *top,
+			      const unsigned char *bottom, unsigned int u,
+			      const struct bilinear_map *map,
+			      unsigned char *dst)
+{
+  const __m128i u16 = _mm_set1_epi16(u);
+  const __m128i compact =
+    _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  int i;
+
+  for (i = 0; i + 4 <= map->safe; i += 4, dst += 12)
+    {
+      const struct bilinear_tap *c = &map->columns[i];
+      __m128i top_w, bottom_w, p0, p1, p2, p3;
+      __m256i weights;
+
+      bilinear_weights_sse2(_mm_loadl_epi64((const __m128i *)
+					    &map->column_weight[i]),
+			    u16, &top_w, &bottom_w);
+      weights = _mm256_inserti128_si256(_mm256_castsi128_si256(top_w),
+					bottom_w, 1);
+#define PIXEL(K, IMM)							\
+      bilinear_pixel_avx2(top + c[K].offset, bottom + c[K].offset,	\
+			  _mm256_shuffle_epi32(weights, IMM))
+      p0 = PIXEL(0, 0x00);
+      p1 = PIXEL(1, 0x55);
+      p2 = PIXEL(2, 0xaa);
+      p3 = PIXEL(3, 0xff);
+#undef PIXEL
+
+      __m128i bytes = _mm_shuffle_epi8(_mm_packus_epi16(_mm_packs_epi32(p0,
+									p1),
+							_mm_packs_epi32(p2,
+									p3)),
+				       compact);
+      memcpy(dst, &bytes, 12);
+    }
+
+  bilinear_span_scalar(top, bottom, u, map, i, dst);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+static bilinear_row_fn bilinear_kernel(int bytes)
+{
+#ifdef HAVE_X86_SIMD
+  if (bytes == 4)
+    return CPU_HAS("sse2") ? bilinear_row32_sse2 : bilinear_row_scalar;
+  if (bytes == 1)
+    return bilinear_row_scalar;
+  if (CPU_HAS("avx2"))
+    return bilinear_row_avx2;
+  if (CPU_HAS("sse2"))
+    return bilinear_row_sse2;
+#endif
+  return bilinear_row_scalar;
+}
+
+
+// Work out where every output row and column samples the source,
+// which is STRIDE bytes to a row and BYTES to a pixel.
+static void bilinear_map_init(struct bilinear_map *map, int width,
+			      int height, int stride, int bytes, int w, int h)
+{
+  map->w = w;
+  map->h = h;
+  map->row_bytes = stride;
+  map->bytes = bytes;
+  map->columns = xmalloc(w * sizeof(struct bilinear_tap));
+  map->rows = xmalloc(h * sizeof(struct bilinear_tap));
+  // Room for a full vector load past the last column.
+  map->column_weight = xcalloc(w + 8, sizeof(unsigned short));
+  map->row_weight = xmalloc(h * sizeof(unsigned short));
+
+  bilinear_axis(width, w, bytes, map->columns, map->column_weight, 0);
+  bilinear_axis(height, h, 1, map->rows, map->row_weight, 1);
+
+  map->safe = w;
+  while (map->safe > 0
+	 && map->columns[map->safe - 1].offset + 8 > map->row_bytes)
+    map->safe--;
+}
+
+static void bilinear_map_free(struct bilinear_map *map)
+{
+  free(map->columns);
+  free(map->rows);
+  free(map->column_weight);
+  free(map->row_weight);
+}
+
+
+struct bilinear_job
+{
+  const unsigned char *src;
+  unsigned char *dst;
+  int stride;
+  const struct bilinear_map *map;
+  bilinear_row_fn row_fn;
+};
+
+static void bilinear_band(void *arg, int first, int end)
+{
+  struct bilinear_job *job = arg;
+  const struct bilinear_map *map = job->map;
+  unsigned char *dst = job->dst + (size_t) job->stride * first;
+
+  for (int j = first; j < end; j++, dst += job->stride)
+    {
+      const unsigned char *top =
+	job->src + map->row_bytes * map->rows[j].offset;
+
+      job->row_fn(top, top + map->row_bytes * map->rows[j].step,
+		  map->row_weight[j], map, dst);
+    }
+}
+
+
+// The per-column and per-row sample positions and weights are worked
+// out once up front, which leaves every output row independent of the
+// others.  Every kernel gives the same bytes as the scalar one.
+static void resample_bilinear(const unsigned char *src, int width,
+			      int height, int src_stride, unsigned char *dst,
+			      int w, int h, int dst_stride, int bytes)
+{
+  struct bilinear_map map;
+  struct bilinear_job job = {src, dst, dst_stride, &map,
+			     bilinear_kernel(bytes)};
+
+  bilinear_map_init(&map, width, height, src_stride, bytes, w, h);
+  band_run(h, bilinear_band, &job);
+  bilinear_map_free(&map);
+}
+
+
+// The other filters are separable: a pass along each row to the new
+// width, then one down the columns to the new height.  Each output
+// pixel along an axis is a weighted sum of TAPS neighbouring source
+// pixels, with the weights in fixed point and worked out once per
+// axis.  Near the edges the run of taps is moved inwards and padded
+// with zero weights, so no pass needs bounds checks.
+
+#define FILTER_BITS 14
+#define FILTER_ONE (1 << FILTER_BITS)
+
+struct filter_axis
+{
+  int n, taps;
+  int *first;			// First source pixel for each output one.
+  int *weight;			// TAPS per output pixel, adding up to one.
+};
+
+static double sinc(double x)
+{
+  if (x == 0)
+    return 1;
+  x *= M_PI;
+  return sin(x) / x;
+}
+
+static double lanczos3(double x)
+{
+  return x > -3 && x < 3 ? sinc(x) * sinc(x / 3) : 0;
+}
+
+// Weigh N samples across SIZE source pixels.
+static void filter_axis_init(struct filter_axis *axis, int size, int n,
+			     int filter)
+{
+  double scale = (double) size / n;
+  // Shrinking widens the filter to cover every source pixel.
+  double stretch = scale > 1 ? scale : 1;
+  double support = (filter == FILTER_LANCZOS3 ? 3 : 0.5) * stretch;
+  double *k;
+
+  axis->n = n;
+  axis->taps = filter == FILTER_NEAREST ? 1 : 2 * (int) ceil(support) + 1;
+  if (axis->taps > size)
+    axis->taps = size;
+  axis->first = xmalloc(n * sizeof(int));
+  axis->weight = xcalloc((size_t) n * axis->taps, sizeof(int));
+  k = xmalloc(axis->taps * sizeof(double));
+
+  for (int i = 0; i < n; i++)
+    {
+      double center = (i + 0.5) * scale, total = 0;
+      int *weight = axis->weight + axis->taps * i;
+      int lo, hi, pad, sum = 0, big = 0;
+
+      if (filter == FILTER_NEAREST)
+	{
+	  lo = (int) center;
+	  axis->first[i] = lo < size ? lo : size - 1;
+	  weight[0] = FILTER_ONE;
+	  continue;
+	}
+
+      lo = (int) floor(center - support + 0.5);
+      hi = (int) floor(center + support + 0.5);
+      lo = lo < 0 ? 0 : lo;
+      hi = hi > size ? size : hi;
+      if (hi - lo > axis->taps)
+	hi = lo + axis->taps;
+      pad = lo + axis->taps > size ? lo + axis->taps - size : 0;
+      axis->first[i] = lo - pad;
+
+      for (int x = lo; x < hi; x++)
+	{
+	  double w;
+
+	  if (filter == FILTER_BOX)
+	    {
+	      // The part of source pixel X the output pixel covers.
+	      double from = center - support, to = center + support;
+
+	      w = (x + 1 < to ? x + 1 : to) - (x > from ? x : from);
+	      w = w > 0 ? w : 0;
+	    }
+	  else
+	    w = lanczos3((x + 0.5 - center) / stretch);
+	  k[x - lo] = w;
+	  total += w;
+	}
+
+      // Round to fixed point, and give what rounding lost or gained to
+      // the heaviest tap so the weights add up to exactly one.
+      for (int x = 0; x < hi - lo; x++)
+	{
+	  weight[pad + x] = (int) floor(k[x] / total * FILTER_ONE + 0.5);
+	  sum += weight[pad + x];
+	  if (abs(weight[pad + x]) > abs(weight[pad + big]))
+	    big = x;
+	}
+      weight[pad + big] += FILTER_ONE - sum;
+    }
+
+  free(k);
+}
+
+static void filter_axis_free(struct filter_axis *axis)
+{
+  free(axis->first);
+  free(axis->weight);
+}
+
+static inline unsigned char filter_clamp(int sum)
+{
+  if (sum < 0)
+    return 0;
+  sum >>= FILTER_BITS;
+  return sum > 255 ? 255 : sum;
+}
+
+// One source row to the new width.
+static inline void filter_row_bytes(const unsigned char *src,
+				    const struct filter_axis *axis,
+				    unsigned char *dst, const int bytes)
+{
+  for (int i = 0; i < axis->n; i++, dst += bytes)
+    {
+      const unsigned char *pixel = src + bytes * axis->first[i];
+      const int *weight = axis->weight + axis->taps * i;
+      int sum[4] = {FILTER_ONE / 2, FILTER_ONE / 2, FILTER_ONE / 2,
+		    FILTER_ONE / 2};
+
+      for (int k = 0; k < axis->taps; k++, pixel += bytes)
+	for (int c = 0; c < bytes; c++)
+	  sum[c] += weight[k] * pixel[c];
+      for (int c = 0; c < bytes; c++)
+	dst[c] = filter_clamp(sum[c]);
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Four-byte pixels take two taps a step, each pixel and the next one
+// interleaved by channel against the pair of weights.  The weights fit
+// in 16 bits, and the packs saturate just as filter_clamp does.
+TARGET_SSE2
+static void filter_row32_sse2(const unsigned char *src,
+			      const struct filter_axis *axis,
+			      unsigned char *dst)
+{
+  const __m128i zero = _mm_setzero_si128();
+
+  for (int i = 0; i < axis->n; i++, dst += 4)
+    {
+      const unsigned char *pixel = src + 4 * axis->first[i];
+      const int *weight = axis->weight + axis->taps * i;
+      __m128i sum = _mm_set1_epi32(FILTER_ONE / 2), lanes;
+      unsigned int pair;
+      int k;
+
+      for (k = 0; k + 2 <= axis->taps; k += 2, pixel += 8)
+	{
+	  lanes = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) pixel),
+				    zero);
+	  lanes = _mm_unpacklo_epi16(lanes, _mm_srli_si128(lanes, 8));
+	  pair = (weight[k] & 0xffff) | (unsigned int) weight[k + 1] << 16;
+	  sum = _mm_add_epi32(sum, _mm_madd_epi16(lanes,
+						  _mm_set1_epi32(pair)));
+	}
+      if (k < axis->taps)
+	{
+	  memcpy(&pair, pixel, 4);
+	  lanes = _mm_unpacklo_epi8(_mm_cvtsi32_si128(pair), zero);
+	  lanes = _mm_unpacklo_epi16(lanes, zero);
+	  sum = _mm_add_epi32(sum, _mm_madd_epi16(lanes,
+						  _mm_set1_epi32(weight[k]
+								 & 0xffff)));
+	}
+
+      sum = _mm_srai_epi32(sum, FILTER_BITS);
+      sum = _mm_packus_epi16(_mm_packs_epi32(sum, sum), zero);
+      pair = _mm_cvtsi128_si32(sum);
+      memcpy(dst, &pair, 4);
+    }
+}
+
+#endif
+
+static void filter_row(const unsigned char *src,
+		       const struct filter_axis *axis, int bytes,
+		       unsigned char *dst)
+{
+#ifdef HAVE_X86_SIMD
+  if (bytes == 4 && CPU_HAS("sse2"))
+    {
+      filter_row32_sse2(src, axis, dst);
+      return;
+    }
+#endif
+  if (bytes == 4)
+    filter_row_bytes(src, axis, dst, 4);
+  else if (bytes == 3)
+    filter_row_bytes(src, axis, dst, 3);
+  else
+    filter_row_bytes(src, axis, dst, 1);
+}
+
+// Output row J from the rows already at the new width.  ROWS[K] is
+// that of source row first[J] + K.  ACC holds BYTES ints.
+static void filter_column(const unsigned char *const *rows,
+			  const struct filter_axis *axis, int j, int bytes,
+			  int *acc, unsigned char *dst)
+{
+  const int *weight = axis->weight + axis->taps * j;
+
+  for (int i = 0; i < bytes; i++)
+    acc[i] = FILTER_ONE / 2;
+  for (int k = 0; k < axis->taps; k++)
+    {
+      const unsigned char *row = rows[k];
+      int w = weight[k];
+
+      if (w)
+	for (int i = 0; i < bytes; i++)
+	  acc[i] += w * row[i];
+    }
+  for (int i = 0; i < bytes; i++)
+    dst[i] = filter_clamp(acc[i]);
+}
+
+
+struct filter_job
+{
+  const unsigned char *src;
+  unsigned char *narrow, *dst;	// NARROW is the source at the new width.
+  int src_stride, dst_stride, bytes;
+  struct filter_axis columns, rows;
+};
+
+static void filter_row_band(void *arg, int first, int end)
+{
+  struct filter_job *job = arg;
+
+  for (int j = first; j < end; j++)
+    filter_row(job->src + (size_t) job->src_stride * j, &job->columns,
+	       job->bytes,
+	       job->narrow + (size_t) job->bytes * job->columns.n * j);
+}
+
+static void filter_column_band(void *arg, int first, int end)
+{
+  struct filter_job *job = arg;
+  int bytes = job->bytes * job->columns.n;
+  const unsigned char **rows = xmalloc(job->rows.taps * sizeof(*rows));
+  int *acc = xmalloc(bytes * sizeof(int));
+
+  for (int j = first; j < end; j++)
+    {
+      for (int k = 0; k < job->rows.taps; k++)
+	rows[k] = job->narrow + bytes * (job->rows.first[j] + k);
+      filter_column(rows, &job->rows, j, bytes, acc,
+		    job->dst + (size_t) job->dst_stride * j);
+    }
+
+  free(acc);
+  free(rows);
+}
+
+static void resample_separable(const unsigned char *src, int width,
+			       int height, int src_stride, unsigned char *dst,
+			       int w, int h, int dst_stride, int bytes,
+			       int filter)
+{
+  struct filter_job job;
+
+  job.src = src;
+  job.dst = dst;
+  job.src_stride = src_stride;
+  job.dst_stride = dst_stride;
+  job.bytes = bytes;
+  filter_axis_init(&job.columns, width, w, filter);
+  filter_axis_init(&job.rows, height, h, filter);
+  job.narrow = xmalloc((size_t) bytes * w * height);
+
+  band_run(height, filter_row_band, &job);
+  band_run(h, filter_column_band, &job);
+
+  free(job.narrow);
+  filter_axis_free(&job.columns);
+  filter_axis_free(&job.rows);
+}
+
+
+// Some ratios need none of the above.  The same size is a copy.
+// Shrinking by whole numbers both ways averages each block of source
+// pixels, which is what the box filter comes to there.  Bilinear
+// halving takes the same average, since each output pixel lies in the
+// middle of its block; at other ratios bilinear samples.  Growing by
+// whole numbers, bilinear weights repeat with the ratio and so are
+// worked out once.  Nearest picks pixels, and whenever it picks the
+// same source row again just repeats the last output row.
+
+#define METHOD_COPY 0
+#define METHOD_BLOCK 1
+#define METHOD_NEAREST 2
+#define METHOD_BILINEAR 3
+#define METHOD_SEPARABLE 4
+#define METHOD_ZOOM 5
+
+// Bigger blocks could overflow the sums.
+#define MAX_BLOCK_AREA 65536
+// The biggest ratio the zoom tables have room for.
+#define MAX_ZOOM 16
+
+struct block
+{
+  int kx, ky, area;
+  int shift;			// Log2 of AREA if a power of two, else -1.
+};
+
+// A bilinear upscale by whole numbers, KX across and KY down.  The
+// samples sit at pixel centers, so output pixel I lies (2I + 1 - K) /
+// 2K of the way past source pixel I / K.  For each of the K output
+// pixels from one source pixel that is a step BACK to the left one of
+// the pair it falls between, 1 or 0, and the WEIGHT of the right one in
+// 256ths.
+struct zoom
+{
+  int kx, ky;
+  unsigned char back[2][MAX_ZOOM], weight[2][MAX_ZOOM];	// Across, down.
+};
+
+static int resample_method(int width, int height, int w, int h,
+			   int filter)
+{
+  if (width == w && height == h)
+    return METHOD_COPY;
+  if (filter == FILTER_NEAREST)
+    return METHOD_NEAREST;
+  if (filter == FILTER_BOX && width % w == 0 && height % h == 0
+      && (width / w) * (height / h) <= MAX_BLOCK_AREA)
+    return METHOD_BLOCK;
+  if (filter != FILTER_BILINEAR)
+    return METHOD_SEPARABLE;
+  if (width == 2 * w && height == 2 * h)
+    return METHOD_BLOCK;
+  if (w % width == 0 && h % height == 0
+      && w / width <= MAX_ZOOM && h / height <= MAX_ZOOM)
+    return METHOD_ZOOM;
+  return METHOD_BILINEAR;
+}
+
+static void zoom_init(struct zoom *zoom, int width, int height, int w, int h)
+{
+  zoom->kx = w / width;
+  zoom->ky = h / height;
+  for (int axis = 0; axis < 2; axis++)
+    {
+      int k = axis ? zoom->ky : zoom->kx;
+
+      for (int p = 0; p < k; p++)
+	{
+	  // Truncated toward zero, so the weights are symmetric.
+	  int pos = (2 * p + 1 - k) * 128 / k;
+
+	  zoom->back[axis][p] = pos < 0;
+	  zoom->weight[axis][p] = pos < 0 ? 256 + pos : pos;
+	}
+    }
+}
+
+// The two source rows output row J falls between, and the weight of
+// the lower one.  Past the edges the edge row is used alone.
+static void zoom_rows(const struct zoom *zoom, int height, int j,
+		      int *top, int *bottom, int *weight)
+{
+  int p = j % zoom->ky;
+
+  *top = j / zoom->ky - zoom->back[1][p];
+  *weight = zoom->weight[1][p];
+  if (*top < 0)
+    {
+      *top = 0;
+      *weight = 0;
+    }
+  *bottom = *top + 1 < height ? *top + 1 : *top;
+}
+
+// One pixel WEIGHT of the way from LEFT to RIGHT, in 256ths.
+static inline void zoom_pixel(const unsigned char *left,
+			      const unsigned char *right, int weight,
+			      unsigned short *wide, const int bytes)
+{
+  for (int c = 0; c < bytes; c++)
+    wide[c] = left[c] * (256 - weight) + right[c] * weight;
+}
+
+// Source row SRC, WIDTH pixels, at the new width in WIDE, from pixel
+// FROM up to TO.  The first and last pixels reach past the edges and
+// are clamped; between them the same KX weights go round and round.
+// This is the reference for the vector kernels.
+static inline void zoom_widen_bytes(const unsigned char *src, int width,
+				    const struct zoom *zoom, int from, int to,
+				    unsigned short *wide, const int bytes,
+				    const int kx)
+{
+  const unsigned char *back = zoom->back[0], *weight = zoom->weight[0];
+
+  wide += bytes * kx * from;
+  for (int x = from; x < to; x++)
+    {
+      if (x == 0 || x == width - 1)
+	{
+	  for (int p = 0; p < kx; p++, wide += bytes)
+	    {
+	      int left = x - back[p], right = left + 1;
+
+	      if (left < 0)
+		left = 0;
+	      if (right >= width)
+		right = left;
+	      zoom_pixel(src + bytes * left, src + bytes * right,
+			 left == right ? 0 : weight[p], wide, bytes);
+	    }
+	  continue;
+	}
+      for (int p = 0; p < kx; p++, wide += bytes)
+	{
+	  const unsigned char *left = src + bytes * (x - back[p]);
+
+	  zoom_pixel(left, left + bytes, weight[p], wide, bytes);
+	}
+    }
+}
+
+static void zoom_widen_scalar(const unsigned char *src, int width,
+			      const struct zoom *zoom, int from, int to,
+			      int bytes, unsigned short *wide)
+{
+  // Doubling, the usual case, unrolled.
+  if (zoom->kx == 2)
+    {
+      if (bytes == 4)
+	zoom_widen_bytes(src, width, zoom, from, to, wide, 4, 2);
+      else if (bytes == 3)
+	zoom_widen_bytes(src, width, zoom, from, to, wide, 3, 2);
+      else
+	zoom_widen_bytes(src, width, zoom, from, to, wide, 1, 2);
+    }
+  else if (bytes == 4)
+    zoom_widen_bytes(src, width, zoom, from, to, wide, 4, zoom->kx);
+  else if (bytes == 3)
+    zoom_widen_bytes(src, width, zoom, from, to, wide, 3, zoom->kx);
+  else
+    zoom_widen_bytes(src, width, zoom, from, to, wide, 1, zoom->kx);
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Doubling puts the two output pixels from source pixel C a quarter of
+// the way to its neighbours P and N, so in 256ths they are 192C + 64P
+// and 192C + 64N, which fit 16 bits.  Bytes of the three are loaded
+// side by side, and the sums for each byte only need interleaving a
+// pixel at a time.  The vector kernels start at pixel 1, leaving the
+// clamped first pixel and whatever is left at the end to the scalar
+// code.
+static inline void zoom_double_sse2(__m128i p, __m128i c, __m128i n,
+				    __m128i *even, __m128i *odd)
+{
+  __m128i c192 = _mm_add_epi16(_mm_slli_epi16(c, 7), _mm_slli_epi16(c, 6));
+
+  *even = _mm_add_epi16(c192, _mm_slli_epi16(p, 6));
+  *odd = _mm_add_epi16(c192, _mm_slli_epi16(n, 6));
+}
+
+// Four pixels a step, each a whole 64 bits of sums.
+TARGET_SSE2
+static void zoom_widen32_sse2(const unsigned char *src, int width,
+			      const struct zoom *zoom, unsigned short *wide)
+{
+  const __m128i zero = _mm_setzero_si128();
+  int x;
+
+  zoom_widen_scalar(src, width, zoom, 0, 1, 4, wide);
+  // The last pixel done needs a right neighbour that isn't the edge.
+  for (x = 1; x + 5 <= width; x += 4)
+    {
+      const unsigned char *s = src + 4 * x;
+      __m128i p = _mm_loadu_si128((const __m128i *) (s - 4));
+      __m128i c = _mm_loadu_si128((const __m128i *) s);
+      __m128i n = _mm_loadu_si128((const __m128i *) (s + 4));
+      __m128i even, odd;
+      __m128i *out = (__m128i *) (wide + 8 * x);
+
+      zoom_double_sse2(_mm_unpacklo_epi8(p, zero),
+		       _mm_unpacklo_epi8(c, zero),
+		       _mm_unpacklo_epi8(n, zero), &even, &odd);
+      _mm_storeu_si128(out, _mm_unpacklo_epi64(even, odd));
+      _mm_storeu_si128(out + 1, _mm_unpackhi_epi64(even, odd));
+      zoom_double_sse2(_mm_unpackhi_epi8(p, zero),
+		       _mm_unpackhi_epi8(c, zero),
+		       _mm_unpackhi_epi8(n, zero), &even, &odd);
+      _mm_storeu_si128(out + 2, _mm_unpacklo_epi64(even, odd));
+      _mm_storeu_si128(out + 3, _mm_unpackhi_epi64(even, odd));
+    }
+  zoom_widen_scalar(src, width, zoom, x, width, 4, wide);
+}
+
+// Gray: sixteen pixels a step, interleaved a sum at a time.
+TARGET_SSE2
+static void zoom_widen8_sse2(const unsigned char *src, int width,
+			     const struct zoom *zoom, unsigned short *wide)
+{
+  const __m128i zero = _mm_setzero_si128();
+  int x;
+
+  zoom_widen_scalar(src, width, zoom, 0, 1, 1, wide);
+  for (x = 1; x + 17 <= width; x += 16)
+    {
+      const unsigned char *s = src + x;
+      __m128i p = _mm_loadu_si128((const __m128i *) (s - 1));
+      __m128i c = _mm_loadu_si128((const __m128i *) s);
+      __m128i n = _mm_loadu_si128((const __m128i *) (s + 1));
+      __m128i even, odd;
+      __m128i *out = (__m128i *) (wide + 2 * x);
+
+      zoom_double_sse2(_mm_unpacklo_epi8(p, zero),
+		       _mm_unpacklo_epi8(c, zero),
+		       _mm_unpacklo_epi8(n, zero), &even, &odd);
+      _mm_storeu_si128(out, _mm_unpacklo_epi16(even, odd));
+      _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(even, odd));
+      zoom_double_sse2(_mm_unpackhi_epi8(p, zero),
+		       _mm_unpackhi_epi8(c, zero),
+		       _mm_unpackhi_epi8(n, zero), &even, &odd);
+      _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(even, odd));
+      _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(even, odd));
+    }
+  zoom_widen_scalar(src, width, zoom, x, width, 1, wide);
+}
+
+// Three-byte pixels, four a step: the twelve sums of each kind come
+// in a register and a third, and three lanes at a time of them are
+// shuffled into three registers of output.
+#define LANE(N) 2 * (N), 2 * (N) + 1
+#define NONE -1, -1
+
+TARGET_SSSE3
+static void zoom_widen_ssse3(const unsigned char *src, int width,
+			     const struct zoom *zoom, unsigned short *wide)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i out0_even = _mm_setr_epi8(LANE(0), LANE(1), LANE(2), NONE,
+					  NONE, NONE, LANE(3), LANE(4));
+  const __m128i out0_odd = _mm_setr_epi8(NONE, NONE, NONE, LANE(0),
+					 LANE(1), LANE(2), NONE, NONE);
+  const __m128i out1_even = _mm_setr_epi8(LANE(5), NONE, NONE, NONE,
+					  LANE(6), LANE(7), NONE, NONE);
+  const __m128i out1_even_hi = _mm_setr_epi8(NONE, NONE, NONE, NONE,
+					     NONE, NONE, LANE(0), NONE);
+  const __m128i out1_odd = _mm_setr_epi8(NONE, LANE(3), LANE(4), LANE(5),
+					 NONE, NONE, NONE, LANE(6));
+  const __m128i out2_odd = _mm_setr_epi8(LANE(7), NONE, NONE, NONE,
+					 NONE, NONE, NONE, NONE);
+  const __m128i out2_odd_hi = _mm_setr_epi8(NONE, LANE(0), NONE, NONE,
+					    NONE, LANE(1), LANE(2), LANE(3));
+  const __m128i out2_even_hi = _mm_setr_epi8(NONE, NONE, LANE(1), LANE(2),
+					     LANE(3), NONE, NONE, NONE);
+  int x;
+
+  zoom_widen_scalar(src, width, zoom, 0, 1, 3, wide);
+  // The loads reach 7 bytes past the right neighbour of the last
+  // pixel done.
+  for (x = 1; x + 7 <= width; x += 4)
+    {
+      const unsigned char *s = src + 3 * x;
+      __m128i p = _mm_loadu_si128((const __m128i *) (s - 3));
+      __m128i c = _mm_loadu_si128((const __m128i *) s);
+      __m128i n = _mm_loadu_si128((const __m128i *) (s + 3));
+      __m128i even, odd, even_hi, odd_hi;
+      __m128i *out = (__m128i *) (wide + 6 * x);
+
+      zoom_double_sse2(_mm_unpacklo_epi8(p, zero),
+		       _mm_unpacklo_epi8(c, zero),
+		       _mm_unpacklo_epi8(n, zero), &even, &odd);
+      zoom_double_sse2(_mm_unpackhi_epi8(p, zero),
+		       _mm_unpackhi_epi8(c, zero),
+		       _mm_unpackhi_epi8(n, zero), &even_hi, &odd_hi);
+      _mm_storeu_si128(out, _mm_or_si128(_mm_shuffle_epi8(even, out0_even),
+					 _mm_shuffle_epi8(odd, out0_odd)));
+      _mm_storeu_si128(out + 1,
+		       _mm_or_si128(_mm_or_si128
+				    (_mm_shuffle_epi8(even, out1_even),
+				     _mm_shuffle_epi8(even_hi, out1_even_hi)),
+				    _mm_shuffle_epi8(odd, out1_odd)));
+      _mm_storeu_si128(out + 2,
+		       _mm_or_si128(_mm_or_si128
+				    (_mm_shuffle_epi8(odd, out2_odd),
+				     _mm_shuffle_epi8(odd_hi, out2_odd_hi)),
+				    _mm_shuffle_epi8(even_hi, out2_even_hi)));
+    }
+  zoom_widen_scalar(src, width, zoom, x, width, 3, wide);
+}
+
+#undef LANE
+#undef NONE
+
+#endif /* HAVE_X86_SIMD */
+
+static void zoom_widen(const unsigned char *src, int width,
+		       const struct zoom *zoom, int bytes,
+		       unsigned short *wide)
+{
+#ifdef HAVE_X86_SIMD
+  if (zoom->kx == 2)
+    {
+      if (bytes == 4 && CPU_HAS("sse2"))
+	{
+	  zoom_widen32_sse2(src, width, zoom, wide);
+	  return;
+	}
+      if (bytes == 3 && CPU_HAS("ssse3"))
+	{
+	  zoom_widen_ssse3(src, width, zoom, wide);
+	  return;
+	}
+      if (bytes == 1 && CPU_HAS("sse2"))
+	{
+	  zoom_widen8_sse2(src, width, zoom, wide);
+	  return;
+	}
+    }
+#endif
+  zoom_widen_scalar(src, width, zoom, 0, width, bytes, wide);
+}
+
+// N bytes of output row from the widened rows TOP and BOTTOM, the
+// latter WEIGHT in 256ths.  The sums are in 65536ths, so nothing is
+// rounded until here.
+static void zoom_blend_scalar(const unsigned short *top,
+			      const unsigned short *bottom, int weight,
+			      int n, unsigned char *dst)
+{
+  for (int i = 0; i < n; i++)
+    dst[i] = (top[i] * (256 - weight) + bottom[i] * weight + 32768) >> 16;
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Eight bytes at a time, the products widened to 32 bits.
+TARGET_SSE2
+static void zoom_blend_sse2(const unsigned short *top,
+			    const unsigned short *bottom, int weight, int n,
+			    unsigned char *dst)
+{
+  const __m128i up = _mm_set1_epi16(256 - weight);
+  const __m128i down = _mm_set1_epi16(weight);
+  const __m128i half = _mm_set1_epi32(32768);
+  int i = 0;
+
+  for (; i + 8 <= n; i += 8)
+    {
+      __m128i a = _mm_loadu_si128((const __m128i *) (top + i));
+      __m128i b = _mm_loadu_si128((const __m128i *) (bottom + i));
+      __m128i a_lo = _mm_mullo_epi16(a, up), a_hi = _mm_mulhi_epu16(a, up);
+      __m128i b_lo = _mm_mullo_epi16(b, down);
+      __m128i b_hi = _mm_mulhi_epu16(b, down);
+      __m128i sum0 = _mm_add_epi32(_mm_unpacklo_epi16(a_lo, a_hi),
+				   _mm_unpacklo_epi16(b_lo, b_hi));
+      __m128i sum1 = _mm_add_epi32(_mm_unpackhi_epi16(a_lo, a_hi),
+				   _mm_unpackhi_epi16(b_lo, b_hi));
+
+      sum0 = _mm_srli_epi32(_mm_add_epi32(sum0, half), 16);
+      sum1 = _mm_srli_epi32(_mm_add_epi32(sum1, half), 16);
+      sum0 = _mm_packs_epi32(sum0, sum1);
+      _mm_storel_epi64((__m128i *) (dst + i),
+		       _mm_packus_epi16(sum0, sum0));
+    }
+  zoom_blend_scalar(top + i, bottom + i, weight, n - i, dst + i);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+static void zoom_blend(const unsigned short *top,
+		       const unsigned short *bottom, int weight, int n,
+		       unsigned char *dst)
+{
+#ifdef HAVE_X86_SIMD
+  if (CPU_HAS("sse2"))
+    {
+      zoom_blend_sse2(top, bottom, weight, n, dst);
+      return;
+    }
+#endif
+  zoom_blend_scalar(top, bottom, weight, n, dst);
+}
+
+// Source row N of SRC widened into WIDE[N & 1], unless it already is.
+static const unsigned short *zoom_row(const unsigned char *src, int stride,
+				      int width, int n,
+				      const struct zoom *zoom, int bytes,
+				      unsigned short *wide[2], int have[2])
+{
+  if (have[n & 1] != n)
+    {
+      zoom_widen(src + (size_t) stride * n, width, zoom, bytes,
+		 wide[n & 1]);
+      have[n & 1] = n;
+    }
+  return wide[n & 1];
+}
+
+static void block_init(struct block *block, int width, int height, int w,
+		       int h)
+{
+  block->kx = width / w;
+  block->ky = height / h;
+  block->area = block->kx * block->ky;
+  block->shift = -1;
+  if (!(block->area & (block->area - 1)))
+    for (block->shift = 0; 1 << block->shift < block->area; block->shift++)
+      ;
+}
+
+// Add the sums of each KX pixels of source row SRC to ACC.
+static inline void block_add_bytes(const unsigned char *src, int w,
+				   const struct block *block, int *acc,
+				   const int bytes)
+{
+  if (block->kx == 2)
+    for (int i = 0; i < bytes * w; i += bytes, src += 2 * bytes)
+      for (int c = 0; c < bytes; c++)
+	acc[i + c] += src[c] + src[c + bytes];
+  else
+    for (int i = 0; i < bytes * w; i += bytes)
+      for (int k = 0; k < block->kx; k++, src += bytes)
+	for (int c = 0; c < bytes; c++)
+	  acc[i + c] += src[c];
+}
+
+static void block_add(const unsigned char *src, int w, int bytes,
+		      const struct block *block, int *acc)
+{
+  if (bytes == 4)
+    block_add_bytes(src, w, block, acc, 4);
+  else if (bytes == 3)
+    block_add_bytes(src, w, block, acc, 3);
+  else
+    block_add_bytes(src, w, block, acc, 1);
+}
+
+// The common halving in one go: output pixels FROM up to W from rows
+// TOP and BOTTOM.  This is the reference for the vector kernels.
+static inline void block_halve_bytes(const unsigned char *top,
+				     const unsigned char *bottom, int w,
+				     int from, unsigned char *dst,
+				     const int bytes)
+{
+  top += 2 * bytes * from;
+  bottom += 2 * bytes * from;
+  for (int i = bytes * from; i < bytes * w;
+       i += bytes, top += 2 * bytes, bottom += 2 * bytes)
+    for (int c = 0; c < bytes; c++)
+      dst[i + c] = (top[c] + top[c + bytes] + bottom[c] + bottom[c + bytes]
+		    + 2) >> 2;
+}
+
+static void block_halve_scalar(const unsigned char *top,
+			       const unsigned char *bottom, int w, int from,
+			       int bytes, unsigned char *dst)
+{
+  if (bytes == 4)
+    block_halve_bytes(top, bottom, w, from, dst, 4);
+  else if (bytes == 3)
+    block_halve_bytes(top, bottom, w, from, dst, 3);
+  else
+    block_halve_bytes(top, bottom, w, from, dst, 1);
+}
+
+#ifdef HAVE_X86_SIMD
+
+// Three output pixels a step.  Adding each row to itself three bytes on
+// gives every byte the sum with its right neighbour; the wanted ones
+// are the first three of every six.
+TARGET_SSSE3
+static void block_halve_ssse3(const unsigned char *top,
+			      const unsigned char *bottom, int w, int from,
+			      unsigned char *dst)
+{
+  const __m128i zero = _mm_setzero_si128(), two = _mm_set1_epi16(2);
+  const __m128i pick = _mm_setr_epi8(0, 1, 2, 6, 7, 8, 12, 13, 14,
+				     -1, -1, -1, -1, -1, -1, -1);
+  int i;
+
+  // The loads reach 18 bytes past a pair and the store 16 past a pixel.
+  for (i = from; i + 6 <= w; i += 3)
+    {
+      const unsigned char *t = top + 6 * i, *b = bottom + 6 * i;
+      __m128i t0 = _mm_loadu_si128((const __m128i *) t);
+      __m128i t3 = _mm_loadu_si128((const __m128i *) (t + 3));
+      __m128i b0 = _mm_loadu_si128((const __m128i *) b);
+      __m128i b3 = _mm_loadu_si128((const __m128i *) (b + 3));
+      __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(t0, zero),
+					       _mm_unpacklo_epi8(t3, zero)),
+				 _mm_add_epi16(_mm_unpacklo_epi8(b0, zero),
+					       _mm_unpacklo_epi8(b3, zero)));
+      __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(t0, zero),
+					       _mm_unpackhi_epi8(t3, zero)),
+				 _mm_add_epi16(_mm_unpackhi_epi8(b0, zero),
+					       _mm_unpackhi_epi8(b3, zero)));
+
+      lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+      hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+      _mm_storeu_si128((__m128i *) (dst + 3 * i),
+		       _mm_shuffle_epi8(_mm_packus_epi16(lo, hi), pick));
+    }
+  block_halve_scalar(top, bottom, w, i, 3, dst);
+}
+
+// Four-byte pixels pair up within a register without any shuffling.
+TARGET_SSE2
+static void block_halve32_sse2(const unsigned char *top,
+			       const unsigned char *bottom, int w,
+			       unsigned char *dst)
+{
+  const __m128i zero = _mm_setzero_si128(), two = _mm_set1_epi16(2);
+  int i;
+
+  for (i = 0; i + 4 <= w; i += 4)
+    {
+      const unsigned char *t = top + 8 * i, *b = bottom + 8 * i;
+      __m128i t0 = _mm_loadu_si128((const __m128i *) t);
+      __m128i t1 = _mm_loadu_si128((const __m128i *) (t + 16));
+      __m128i b0 = _mm_loadu_si128((const __m128i *) b);
+      __m128i b1 = _mm_loadu_si128((const __m128i *) (b + 16));
+      // Vertical sums of source pixels 0-1, 2-3, 4-5 and 6-7.
+      __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(t0, zero),
+				 _mm_unpacklo_epi8(b0, zero));
+      __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(t0, zero),
+				 _mm_unpackhi_epi8(b0, zero));
+      __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(t1, zero),
+				 _mm_unpacklo_epi8(b1, zero));
+      __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(t1, zero),
+				 _mm_unpackhi_epi8(b1, zero));
+      __m128i lo = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1),
+				 _mm_unpackhi_epi64(s0, s1));
+      __m128i hi = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3),
+				 _mm_unpackhi_epi64(s2, s3));
+
+      lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+      hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+      _mm_storeu_si128((__m128i *) (dst + 4 * i), _mm_packus_epi16(lo, hi));
+    }
+  block_halve_scalar(top, bottom, w, i, 4, dst);
+}
+
+#endif
+
+static void block_halve(const unsigned char *top, const unsigned char *bottom,
+			int w, int bytes, unsigned char *dst)
+{
+#ifdef HAVE_X86_SIMD
+  if (bytes == 4 && CPU_HAS("sse2"))
+    {
+      block_halve32_sse2(top, bottom, w, dst);
+      return;
+    }
+  if (bytes == 3 && CPU_HAS("ssse3"))
+    {
+      block_halve_ssse3(top, bottom, w, 0, dst);
+      return;
+    }
+#endif
+  block_halve_scalar(top, bottom, w, 0, bytes, dst);
+}
+
+// Round the block sums in ACC to averages in DST and clear ACC.
+static void block_finish(int *acc, int bytes, const struct block *block,
+			 unsigned char *dst)
+{
+  int half = block->area / 2;
+
+  if (block->shift >= 0)
+    for (int i = 0; i < bytes; i++)
+      {
+	dst[i] = (acc[i] + half) >> block->shift;
+	acc[i] = 0;
+      }
+  else
+    for (int i = 0; i < bytes; i++)
+      {
+	dst[i] = (acc[i] + half) / block->area;
+	acc[i] = 0;
+      }
+}
+
+// Source row SRC at the new width, one pixel per column.
+static inline void nearest_row_bytes(const unsigned char *src,
+				     const struct filter_axis *axis,
+				     unsigned char *dst, const int bytes)
+{
+  for (int i = 0; i < axis->n; i++, dst += bytes)
+    memcpy(dst, src + bytes * axis->first[i], bytes);
+}
+
+static void nearest_row(const unsigned char *src,
+			const struct filter_axis *axis, int bytes,
+			unsigned char *dst)
+{
+  if (bytes == 4)
+    nearest_row_bytes(src, axis, dst, 4);
+  else if (bytes == 3)
+    nearest_row_bytes(src, axis, dst, 3);
+  else
+    nearest_row_bytes(src, axis, dst, 1);
+}
+
+
+struct fast_job
+{
+  const unsigned char *src;
+  unsigned char *dst;
+  int src_stride, dst_stride, bytes, w;
+  struct block block;
+  struct filter_axis columns, rows;
+  struct zoom zoom;
+  int width, height;		// Of the source, for zooming.
+};
+
+static void block_band(void *arg, int first, int end)
+{
+  struct fast_job *job = arg;
+  const struct block *block = &job->block;
+  int bytes = job->bytes * job->w;
+  int *acc = xcalloc(bytes, sizeof(int));
+
+  for (int j = first; j < end; j++)
+    {
+      const unsigned char *src = job->src
+	+ (size_t) job->src_stride * block->ky * j;
+      unsigned char *dst = job->dst + (size_t) job->dst_stride * j;
+
+      if (block->kx == 2 && block->ky == 2)
+	{
+	  block_halve(src, src + job->src_stride, job->w, job->bytes, dst);
+	  continue;
+	}
+      for (int k = 0; k < block->ky; k++, src += job->src_stride)
+	block_add(src, job->w, job->bytes, block, acc);
+      block_finish(acc, bytes, block, dst);
+    }
+
+  free(acc);
+}
+
+static void nearest_band(void *arg, int first, int end)
+{
+  struct fast_job *job = arg;
+  unsigned char *dst = job->dst + (size_t) job->dst_stride * first;
+
+  for (int j = first; j < end; j++, dst += job->dst_stride)
+    if (j > first && job->rows.first[j] == job->rows.first[j - 1])
+      memcpy(dst, dst - job->dst_stride, job->bytes * job->w);
+    else
+      nearest_row(job->src + (size_t) job->src_stride * job->rows.first[j],
+		  &job->columns, job->bytes, dst);
+}
+
+
+// Each source row is widened once for all the output rows that use
+// it, at least within a band.
+static void zoom_band(void *arg, int first, int end)
+{
+  struct fast_job *job = arg;
+  const int n = job->bytes * job->w;
+  unsigned short *wide[2];
+  int have[2] = {-1, -1};
+
+  for (int i = 0; i < 2; i++)
+    wide[i] = xmalloc(n * sizeof(unsigned short));
+  for (int j = first; j < end; j++)
+    {
+      int top, bottom, weight;
+
+      zoom_rows(&job->zoom, job->height, j, &top, &bottom, &weight);
+      zoom_blend(zoom_row(job->src, job->src_stride, job->width, top,
+			  &job->zoom, job->bytes, wide, have),
+		 zoom_row(job->src, job->src_stride, job->width, bottom,
+			  &job->zoom, job->bytes, wide, have),
+		 weight, n, job->dst + (size_t) job->dst_stride * j);
+    }
+  free(wide[0]);
+  free(wide[1]);
+}
+
+
+// Resize WIDTH x HEIGHT pixels at SRC to W x H at DST with FILTER.
+// Pixels are BYTES long, 3 or 4, and every byte is filtered on its
+// own, so any channel order will do.  The strides are the bytes from
+// one row to the next.
+void resample_image(const unsigned char *src, int width, int height,
+		    int src_stride, unsigned char *dst, int w, int h,
+		    int dst_stride, int bytes, int filter)
+{
+  struct fast_job job = {src, dst, src_stride, dst_stride, bytes, w};
+
+  switch (resample_method(width, height, w, h, filter))
+    {
+    case METHOD_COPY:
+      for (int j = 0; j < h; j++)
+	memcpy(dst + (size_t) dst_stride * j, src + (size_t) src_stride * j,
+	       (size_t) bytes * w);
+      break;
+    case METHOD_BLOCK:
+      block_init(&job.block, width, height, w, h);
+      band_run(h, block_band, &job);
+      break;
+    case METHOD_NEAREST:
+      filter_axis_init(&job.columns, width, w, FILTER_NEAREST);
+      filter_axis_init(&job.rows, height, h, FILTER_NEAREST);
+      band_run(h, nearest_band, &job);
+      filter_axis_free(&job.columns);
+      filter_axis_free(&job.rows);
+      break;
+    case METHOD_BILINEAR:
+      resample_bilinear(src, width, height, src_stride, dst, w, h,
+			dst_stride, bytes);
+      break;
+    case METHOD_ZOOM:
+      zoom_init(&job.zoom, width, height, w, h);
+      job.width = width;
+      job.height = height;
+      band_run(h, zoom_band, &job);
+      break;
+    default:
+      resample_separable(src, width, height, src_stride, dst, w, h,
+			 dst_stride, bytes, filter);
+      break;
+    }
+}
+
+
+// The same resize, fed one source row at a time from SOURCE and
+// producing output rows on demand.  Bilinear keeps just the two source
+// rows the next output row falls between, and the separable filters a
+// ring of as many rows as they have taps, already at the new width.
+// The shortcuts need at most the last source row read.  Pixels are
+// as the source hands them out, RGB or 32-bit.
+struct resample_stream
+{
+  struct row_source *source;
+  int method, rows_read, next, bytes;
+  struct block block;
+
+  struct bilinear_map map;
+  bilinear_row_fn row_fn;
+  unsigned char *window[2];	// Source row N is in window[N & 1].
+
+  struct zoom zoom;
+  unsigned short *wide[2];	// Source row N, widened, in wide[N & 1].
+
+  struct filter_axis columns, rows;
+  unsigned char **ring;		// Source row N is in ring[N % taps].
+  const unsigned char **taps;
+  unsigned char *src_row;
+  int *acc;			// Also the block sums.
+};
+
+struct resample_stream *resample_stream_open(struct row_source *source,
+					     int w, int h, int filter)
+{
+  struct resample_stream *stream = xcalloc(1, sizeof(*stream));
+  const int bytes = layout_channels[source->layout][0];
+
+  stream->source = source;
+  stream->bytes = bytes;
+  stream->method = resample_method(source->width, source->height, w, h,
+				   filter);
+  switch (stream->method)
+    {
+    case METHOD_COPY:
+      return stream;
+    case METHOD_BLOCK:
+      block_init(&stream->block, source->width, source->height, w, h);
+      // Two rows for halving.
+      stream->src_row = xmalloc(2 * bytes * source->width);
+      stream->acc = xcalloc(bytes * w, sizeof(int));
+      return stream;
+    case METHOD_NEAREST:
+      filter_axis_init(&stream->columns, source->width, w, filter);
+      filter_axis_init(&stream->rows, source->height, h, filter);
+      stream->src_row = xmalloc(bytes * source->width);
+      return stream;
+    case METHOD_BILINEAR:
+      bilinear_map_init(&stream->map, source->width, source->height,
+			bytes * source->width, bytes, w, h);
+      stream->row_fn = bilinear_kernel(bytes);
+      for (int i = 0; i < 2; i++)
+	stream->window[i] = xmalloc(stream->map.row_bytes);
+      return stream;
+    case METHOD_ZOOM:
+      zoom_init(&stream->zoom, source->width, source->height, w, h);
+      for (int i = 0; i < 2; i++)
+	stream->wide[i] = xmalloc(bytes * w * sizeof(unsigned short));
+      stream->src_row = xmalloc(bytes * source->width);
+      return stream;
+    }
+
+  filter_axis_init(&stream->columns, source->width, w, filter);
+  filter_axis_init(&stream->rows, source->height, h, filter);
+  stream->ring = xmalloc(stream->rows.taps * sizeof(*stream->ring));
+  for (int i = 0; i < stream->rows.taps; i++)
+    stream->ring[i] = xmalloc(bytes * w);
+  stream->taps = xmalloc(stream->rows.taps * sizeof(*stream->taps));
+  stream->src_row = xmalloc(bytes * source->width);
+  stream->acc = xmalloc(bytes * w * sizeof(int));
+  return stream;
+}
+
+static int resample_stream_bilinear(struct resample_stream *stream,
+				    unsigned char *dst, int rows)
+{
+  struct bilinear_map *map = &stream->map;
+
+  for (; rows--; dst += stream->bytes * map->w, stream->next++)
+    {
+      const struct bilinear_tap *row = &map->rows[stream->next];
+      int last = row->offset + row->step;
+
+      while (stream->rows_read <= last)
+	{
+	  if (!stream->source->read_row(stream->source,
+					stream->window[stream->rows_read & 1]))
+	    return 0;
+	  stream->rows_read++;
+	}
+      stream->row_fn(stream->window[row->offset & 1],
+		     stream->window[last & 1],
+		     map->row_weight[stream->next], map, dst);
+    }
+  return 1;
+}
+
+static int resample_stream_zoom(struct resample_stream *stream,
+				unsigned char *dst, int rows)
+{
+  const int width = stream->source->width, bytes = stream->bytes;
+  const int n = bytes * width * stream->zoom.kx;
+
+  for (; rows--; dst += n, stream->next++)
+    {
+      int top, bottom, weight;
+
+      zoom_rows(&stream->zoom, stream->source->height, stream->next,
+		&top, &bottom, &weight);
+      while (stream->rows_read <= bottom)
+	{
+	  if (!stream->source->read_row(stream->source, stream->src_row))
+	    return 0;
+	  zoom_widen(stream->src_row, width, &stream->zoom, bytes,
+		     stream->wide[stream->rows_read & 1]);
+	  stream->rows_read++;
+	}
+      zoom_blend(stream->wide[top & 1], stream->wide[bottom & 1], weight,
+		 n, dst);
+    }
+  return 1;
+}
+
+static int resample_stream_separable(struct resample_stream *stream,
+				     unsigned char *dst, int rows)
+{
+  const struct filter_axis *axis = &stream->rows;
+  const int n = stream->bytes * stream->columns.n;
+
+  for (; rows--; dst += n, stream->next++)
+    {
+      int first = axis->first[stream->next];
+
+      // The first rows only ever move down, so the ring never drops a
+      // row that is still wanted.
+      while (stream->rows_read < first + axis->taps)
+	{
+	  if (!stream->source->read_row(stream->source, stream->src_row))
+	    return 0;
+	  filter_row(stream->src_row, &stream->columns, stream->bytes,
+		     stream->ring[stream->rows_read % axis->taps]);
+	  stream->rows_read++;
+	}
+      for (int k = 0; k < axis->taps; k++)
+	stream->taps[k] = stream->ring[(first + k) % axis->taps];
+      filter_column(stream->taps, axis, stream->next, n, stream->acc, dst);
+    }
+  return 1;
+}
+
+static int resample_stream_block(struct resample_stream *stream,
+				 unsigned char *dst, int rows)
+{
+  const struct block *block = &stream->block;
+  const int bytes = stream->bytes;
+  int w = stream->source->width / block->kx;
+
+  for (; rows--; dst += bytes * w)
+    {
+      if (block->kx == 2 && block->ky == 2)
+	{
+	  unsigned char *bottom =
+	    stream->src_row + bytes * stream->source->width;
+
+	  if (!stream->source->read_row(stream->source, stream->src_row)
+	      || !stream->source->read_row(stream->source, bottom))
+	    return 0;
+	  block_halve(stream->src_row, bottom, w, bytes, dst);
+	  continue;
+	}
+      for (int k = 0; k < block->ky; k++)
+	{
+	  if (!stream->source->read_row(stream->source, stream->src_row))
+	    return 0;
+	  block_add(stream->src_row, w, bytes, block, stream->acc);
+	}
+      block_finish(stream->acc, bytes * w, block, dst);
+    }
+  return 1;
+}
+
+static int resample_stream_nearest(struct resample_stream *stream,
+				   unsigned char *dst, int rows)
+{
+  for (; rows--; dst += stream->bytes * stream->columns.n, stream->next++)
+    {
+      // SRC_ROW holds source row ROWS_READ - 1.
+      while (stream->rows_read <= stream->rows.first[stream->next])
+	{
+	  if (!stream->source->read_row(stream->source, stream->src_row))
+	    return 0;
+	  stream->rows_read++;
+	}
+      nearest_row(stream->src_row, &stream->columns, stream->bytes, dst);
+    }
+  return 1;
+}
+
+// Write the next ROWS output rows to DST.  Returns 0 if the source
+// fails, after which the stream is of no further use.
+int resample_stream_rows(struct resample_stream *stream, unsigned char *dst,
+			 int rows)
+{
+  switch (stream->method)
+    {
+    case METHOD_COPY:
+      for (; rows--; dst += stream->bytes * stream->source->width)
+	if (!stream->source->read_row(stream->source, dst))
+	  return 0;
+      return 1;
+    case METHOD_BLOCK:
+      return resample_stream_block(stream, dst, rows);
+    case METHOD_NEAREST:
+      return resample_stream_nearest(stream, dst, rows);
+    case METHOD_BILINEAR:
+      return resample_stream_bilinear(stream, dst, rows);
+    case METHOD_ZOOM:
+      return resample_stream_zoom(stream, dst, rows);
+    }
+  return resample_stream_separable(stream, dst, rows);
+}
+
+void resample_stream_close(struct resample_stream *stream)
+{
+  if (stream->method == METHOD_BILINEAR)
+    {
+      bilinear_map_free(&stream->map);
+      free(stream->window[0]);
+      free(stream->window[1]);
+    }
+  else if (stream->method == METHOD_ZOOM)
+    {
+      free(stream->wide[0]);
+      free(stream->wide[1]);
+    }
+  else if (stream->method == METHOD_SEPARABLE
+	   || stream->method == METHOD_NEAREST)
+    {
+      if (stream->ring)
+	for (int i = 0; i < stream->rows.taps; i++)
+	  free(stream->ring[i]);
+      free(stream->ring);
+      free(stream->taps);
+      filter_axis_free(&stream->columns);
+      filter_axis_free(&stream->rows);
+    }
+  free(stream->src_row);
+  free(stream->acc);
+  free(stream);
+}
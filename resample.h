@@ -0,0 +1,23 @@
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+// Resampling filters.
+#define FILTER_NEAREST 0
+#define FILTER_BILINEAR 1
+#define FILTER_BOX 2		// Averages the area each pixel covers.
+#define FILTER_LANCZOS3 3
+
+struct row_source;
+struct resample_stream;
+
+void resample_image(const unsigned char *src, int width, int height,
+		    int src_stride, unsigned char *dst, int w, int h,
+		    int dst_stride, int bytes, int filter);
+
+struct resample_stream *resample_stream_open(struct row_source *source,
+					     int w, int h, int filter);
+int resample_stream_rows(struct resample_stream *stream, unsigned char *dst,
+			 int rows);
+void resample_stream_close(struct resample_stream *stream);
+
+#endif /* _RESAMPLE_H_ */
@@ -0,0 +1,171 @@
+#include <stddef.h>
+#include <string.h>
+#include "rotate.h"
+
+// Turns that swap axes go tile by tile, so the source rows read and
+// the output rows written both stay in cache.  Taken a row at a time,
+// a 4K frame would touch a fresh line of output for every pixel.
+
+// Source pixel (X, Y) lands at column m[0] * X + m[1] * Y and row
+// m[2] * X + m[3] * Y, counting back from the far edge where negative.
+static const signed char orient_matrix[9][4] = {
+  [ORIENT_NORMAL] = {1, 0, 0, 1},
+  [ORIENT_FLIP_X] = {-1, 0, 0, 1},
+  [ORIENT_ROTATE_180] = {-1, 0, 0, -1},
+  [ORIENT_FLIP_Y] = {1, 0, 0, -1},
+  [ORIENT_TRANSPOSE] = {0, 1, 1, 0},
+  [ORIENT_ROTATE_90] = {0, -1, 1, 0},
+  [ORIENT_TRANSVERSE] = {0, -1, -1, 0},
+  [ORIENT_ROTATE_270] = {0, 1, -1, 0},
+};
+
+
+static unsigned int exif_get(const unsigned char *ptr, int bytes,
+			     int big_endian)
+{
+  unsigned int value = 0;
+
+  for (int i = 0; i < bytes; i++)
+    value |= (unsigned int) ptr[big_endian ? i : bytes - 1 - i]
+      << 8 * (bytes - 1 - i);
+  return value;
+}
+
+
+// Find the orientation tag in EXIF, the body of a JPEG APP1 marker.
+// Anything missing or malformed counts as upright.
+int exif_orientation(const unsigned char *exif, size_t size)
+{
+  const unsigned char *tiff = exif + 6;
+  size_t length, ifd;
+  int big_endian, entries;
+
+  if (size < 6 + 8 || memcmp(exif, "Exif\0\0", 6))
+    return ORIENT_NORMAL;
+  length = size - 6;
+  if (!memcmp(tiff, "MM\0\x2a", 4))
+    big_endian = 1;
+  else if (!memcmp(tiff, "II\x2a\0", 4))
+    big_endian = 0;
+  else
+    return ORIENT_NORMAL;
+
+  if ((ifd = exif_get(tiff + 4, 4, big_endian)) > length - 2)
+    return ORIENT_NORMAL;
+  entries = exif_get(tiff + ifd, 2, big_endian);
+  for (int i = 0; i < entries && ifd + 2 + 12 * (i + 1) <= length; i++)
+    {
+      const unsigned char *entry = tiff + ifd + 2 + 12 * i;
+
+      // A single SHORT, held in the entry itself.
+      if (exif_get(entry, 2, big_endian) == 0x112
+	  && exif_get(entry + 2, 2, big_endian) == 3
+	  && exif_get(entry + 4, 4, big_endian) == 1)
+	{
+	  unsigned int orientation = exif_get(entry + 8, 2, big_endian);
+
+	  return orientation >= ORIENT_NORMAL
+	    && orientation <= ORIENT_ROTATE_270 ? orientation : ORIENT_NORMAL;
+	}
+    }
+  return ORIENT_NORMAL;
+}
+
+
+// The orientation doing FIRST and then THEN comes to.
+int orient_then(int first, int then)
+{
+  const signed char *f = orient_matrix[first], *t = orient_matrix[then];
+  const signed char m[4] = {
+    t[0] * f[0] + t[1] * f[2], t[0] * f[1] + t[1] * f[3],
+    t[2] * f[0] + t[3] * f[2], t[2] * f[1] + t[3] * f[3]
+  };
+
+  for (int orientation = ORIENT_NORMAL; orientation <= ORIENT_ROTATE_270;
+       orientation++)
+    if (!memcmp(orient_matrix[orientation], m, sizeof(m)))
+      return orientation;
+  return ORIENT_NORMAL;
+}
+
+
+static inline void
+orient_rows_bytes(const unsigned char *src, int src_stride,
+		  int width, int rows, unsigned char *dst,
+		  ptrdiff_t x_step, ptrdiff_t y_step, const int bytes)
+{
+  // Source rows stay rows, so just run along them.
+  if (x_step == bytes || x_step == -bytes)
+    {
+      for (int y = 0; y < rows; y++)
+	{
+	  const unsigned char *in = src + (size_t) src_stride * y;
+	  unsigned char *out = dst + y_step * y;
+
+	  if (x_step == bytes)
+	    memcpy(out, in, (size_t) bytes * width);
+	  else
+	    for (int x = 0; x < width; x++, in += bytes, out -= bytes)
+	      memcpy(out, in, bytes);
+	}
+      return;
+    }
+
+  // Source columns become output rows.  Within a tile each output row
+  // is written in one run, down a column of the source.
+  for (int y0 = 0; y0 < rows; y0 += ORIENT_TILE)
+    {
+      const int y1 = y0 + ORIENT_TILE < rows ? y0 + ORIENT_TILE : rows;
+
+      for (int x0 = 0; x0 < width; x0 += ORIENT_TILE)
+	{
+	  const int x1 = x0 + ORIENT_TILE < width ? x0 + ORIENT_TILE : width;
+
+	  for (int x = x0; x < x1; x++)
+	    {
+	      const unsigned char *in = src + (size_t) src_stride * y0
+		+ bytes * x;
+	      unsigned char *out = dst + x_step * x + y_step * y0;
+
+	      for (int y = y0; y < y1; y++, in += src_stride, out += y_step)
+		memcpy(out, in, bytes);
+	    }
+	}
+    }
+}
+
+
+// Put ROWS rows from SRC, which are rows FIRST on of a WIDTH x HEIGHT
+// image, where ORIENTATION takes them in DST.  DST holds the whole
+// turned image, with rows DST_STRIDE bytes apart.  So the image can be
+// turned a strip at a time as it is decoded.
+void orient_rows(const unsigned char *src, int src_stride,
+		 int width, int height, int first, int rows,
+		 unsigned char *dst, int dst_stride,
+		 int orientation, int bytes)
+{
+  const signed char *m = orient_matrix[orientation];
+  const int out_width = ORIENT_SWAPS_AXES(orientation) ? height : width;
+  const int out_height = ORIENT_SWAPS_AXES(orientation) ? width : height;
+  const ptrdiff_t x_step = m[0] * bytes + m[2] * (ptrdiff_t) dst_stride;
+  const ptrdiff_t y_step = m[1] * bytes + m[3] * (ptrdiff_t) dst_stride;
+
+  // Where source pixel (0, FIRST) goes.
+  if (m[0] < 0 || m[1] < 0)
+    dst += (ptrdiff_t) bytes * (out_width - 1);
+  if (m[2] < 0 || m[3] < 0)
+    dst += (ptrdiff_t) dst_stride * (out_height - 1);
+  dst += y_step * first;
+
+  switch (bytes)
+    {
+    case 4:
+      orient_rows_bytes(src, src_stride, width, rows, dst, x_step, y_step, 4);
+      break;
+    case 3:
+      orient_rows_bytes(src, src_stride, width, rows, dst, x_step, y_step, 3);
+      break;
+    default:
+      orient_rows_bytes(src, src_stride, width, rows, dst, x_step, y_step, 1);
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef _ROTATE_H_
+#define _ROTATE_H_
+
+// Orientations as EXIF numbers them: how a stored image has to be
+// turned to show it upright.  The last four swap width and height.
+#define ORIENT_NORMAL 1
+#define ORIENT_FLIP_X 2
+#define ORIENT_ROTATE_180 3
+#define ORIENT_FLIP_Y 4
+#define ORIENT_TRANSPOSE 5
+#define ORIENT_ROTATE_90 6	// Clockwise.
+#define ORIENT_TRANSVERSE 7
+#define ORIENT_ROTATE_270 8
+
+#define ORIENT_SWAPS_AXES(orientation) ((orientation) >= ORIENT_TRANSPOSE)
+
+// Pixels each way in the blocks a turn is done in, and so rows worth
+// collecting before turning them.
+#define ORIENT_TILE 32
+
+int exif_orientation(const unsigned char *exif, size_t size);
+int orient_then(int first, int then);
+void orient_rows(const unsigned char *src, int src_stride,
+		 int width, int height, int first, int rows,
+		 unsigned char *dst, int dst_stride,
+		 int orientation, int bytes);
+
+#endif /* _ROTATE_H_ */
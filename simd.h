@@ -0,0 +1,15 @@
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+// Vector kernels are compiled per function with target attributes and
+// picked at run time, so the greeter still loads on CPUs without them.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define CPU_HAS(FEATURE) __builtin_cpu_supports(FEATURE)
+#endif
+
+#endif /* _SIMD_H_ */
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/Xft/Xft.h>
+#include "cache.h"
+#include "convert.h"
+#include "image.h"
+#include "read.h"
+#include "resample.h"
+#include "stream.h"
+#include "upload.h"
+#include "util.h"
+
+// Rows decoded, scaled, converted and uploaded at a time.  A multiple
+// of 4, so the ordered dithers line up from one strip to the next.
+#define STRIP_ROWS 64
+
+
+// PIXELS of COLOR in LAYOUT, RGB or 32-bit.
+static void fill_rows(unsigned char *rgb, int pixels, int layout,
+		      XftColor *color)
+{
+  const unsigned char *channel = layout_channels[layout];
+  unsigned char pixel[4] = {255, 255, 255, 255};
+
+  pixel[channel[1]] = color->color.red >> 8;
+  pixel[channel[2]] = color->color.green >> 8;
+  pixel[channel[3]] = color->color.blue >> 8;
+  for (; pixels--; rgb += channel[0])
+    memcpy(rgb, pixel, channel[0]);
+}
+
+
+// Build the background pixmap a strip at a time, so that at no point
+// is there a whole screen of pixels on the client side.  SOURCE is
+// scaled to WIDTH x HEIGHT with FILTER, or if NULL the background is
+// COLOR.  The background under PANEL is merged into it on the way
+// past, as merge_with_background would do with the full image.  The result is
+// the same as resize_background and imageToPixmap, apart from not
+// being split over threads.  SOURCE hands out RGB, which goes through
+// the converter, or the server's own 32-bit layout, which is scaled
+// straight into the image that goes up.
+Pixmap streamToPixmap(Display *dpy, struct row_source *source,
+		      XftColor *color, int width, int height, int filter,
+		      struct image *panel, int panel_x, int panel_y,
+		      int scr, Window win, struct cache_entry *cache)
+{
+  const int depth = DefaultDepth(dpy, scr);
+  const int layout = source ? source->layout : native_layout(dpy, scr);
+  Pixmap pixmap = XCreatePixmap(dpy, win, width, height, depth);
+  struct resample_stream *stream = NULL;
+  struct converter conv;
+  struct upload up;
+
+  if (layout == LAYOUT_RGB && !converter_init(&conv, dpy, scr))
+    {
+      fprintf(stderr, "Unsupported visual for image\n");
+      return pixmap;
+    }
+
+  upload_create(&up, dpy, scr, width, STRIP_ROWS);
+  struct image strip = {STRIP_ROWS, width, width * STRIP_ROWS, layout,
+			layout_channels[layout][0] * width, NULL, NULL};
+  // The rows are packed, which 32 bits a pixel always are.
+  const int direct = layout != LAYOUT_RGB
+    && up.ximage->bytes_per_line == strip.stride;
+  GC gc = XCreateGC(dpy, win, 0, NULL);
+
+  strip.rgb_data = direct ? (unsigned char *) up.ximage->data
+    : xmalloc((size_t) strip.stride * STRIP_ROWS);
+  if (source)
+    stream = resample_stream_open(source, width, height, filter);
+  if (cache)
+    cache_store_begin(cache, up.ximage, height);
+
+  for (int y = 0; y < height; y += STRIP_ROWS)
+    {
+      int rows = height - y < STRIP_ROWS ? height - y : STRIP_ROWS;
+
+      if (!stream || !resample_stream_rows(stream, strip.rgb_data, rows))
+	{
+	  // A broken file leaves the rest of the screen plain, and
+	  // that isn't worth keeping.
+	  if (stream)
+	    {
+	      fprintf(stderr, "Background image is corrupt\n");
+	      resample_stream_close(stream);
+	      stream = NULL;
+	      if (cache)
+		cache->store_ok = 0;
+	    }
+	  fill_rows(strip.rgb_data, width * rows, layout, color);
+	}
+
+      if (panel)
+	{
+	  strip.height = rows;
+	  merge_with_background(panel, &strip, panel_x, panel_y - y);
+	}
+
+      if (layout == LAYOUT_RGB)
+	convert_rows(&conv, up.ximage, 0, strip.rgb_data, rows);
+      else if (!direct)
+	for (int j = 0; j < rows; j++)
+	  memcpy(up.ximage->data + (size_t) up.ximage->bytes_per_line * j,
+		 strip.rgb_data + (size_t) strip.stride * j, strip.stride);
+      upload_put(&up, dpy, pixmap, gc, y, rows);
+      if (cache)
+	cache_store_rows(cache, up.ximage, rows);
+    }
+
+  if (cache)
+    cache_store_end(cache);
+  if (stream)
+    resample_stream_close(stream);
+  XFreeGC(dpy, gc);
+  if (!direct)
+    free(strip.rgb_data);
+  upload_destroy(&up, dpy);
+  if (layout == LAYOUT_RGB)
+    converter_free(&conv);
+  return pixmap;
+}
@@ -0,0 +1,9 @@
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+Pixmap streamToPixmap(Display *dpy, struct row_source *source,
+		      XftColor *color, int width, int height, int filter,
+		      struct image *panel, int panel_x, int panel_y,
+		      int scr, Window win, struct cache_entry *cache);
+
+#endif /* _STREAM_H_ */
@@ -1,6 +1,7 @@
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
 
+#include "cache.h"
 #include "image.h"
 #include "cfg.h"
 #include "gfx.h"
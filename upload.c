@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include "upload.h"
+#include "util.h"
+
+#define SHM_UNKNOWN 0
+#define SHM_WORKS 1
+#define SHM_BROKEN 2
+
+static int shm_state = SHM_UNKNOWN;
+static int shm_error;
+static struct upload_stats stats;
+
+
+static int trap_shm_error(Display *dpy, XErrorEvent *event)
+{
+  shm_error = 1;
+  return 0;
+}
+
+
+// The extension is no use to a remote display even if the server has
+// it, since the server can't see our segments.  Anything that slips
+// through this is caught when the attach fails.
+static int shm_possible(Display *dpy)
+{
+  const char *name = DisplayString(dpy);
+
+  if (shm_state == SHM_UNKNOWN)
+    shm_state = XShmQueryExtension(dpy)
+      && (name[0] == ':' || !strncmp(name, "unix:", 5)
+	  || !strncmp(name, "localhost:", 10))
+      ? SHM_WORKS : SHM_BROKEN;
+  return shm_state == SHM_WORKS;
+}
+
+
+// Returns 0, leaving UP alone, if shared memory can't be had.
+static int create_shm(struct upload *up, Display *dpy, int scr, int depth,
+		      int width, int height)
+{
+  XShmSegmentInfo *info;
+  XImage *ximage;
+  int (*old_handler)(Display *, XErrorEvent *);
+
+  if (!shm_possible(dpy))
+    return 0;
+
+  info = xcalloc(1, sizeof(XShmSegmentInfo));
+  if (!(ximage = XShmCreateImage(dpy, DefaultVisual(dpy, scr), depth,
+				 ZPixmap, NULL, info, width, height)))
+    goto fail;
+
+  info->shmid = shmget(IPC_PRIVATE, (size_t) ximage->bytes_per_line * height,
+		       IPC_CREAT | 0600);
+  if (info->shmid < 0)
+    goto fail;
+  info->shmaddr = ximage->data = shmat(info->shmid, NULL, 0);
+  info->readOnly = True;
+  if (info->shmaddr == (char *) -1)
+    {
+      shmctl(info->shmid, IPC_RMID, NULL);
+      goto fail;
+    }
+
+  // Earlier requests mustn't report their errors to our handler.
+  XSync(dpy, False);
+  shm_error = 0;
+  old_handler = XSetErrorHandler(trap_shm_error);
+  XShmAttach(dpy, info);
+  XSync(dpy, False);
+  XSetErrorHandler(old_handler);
+  // The segment goes away once both sides have detached.
+  shmctl(info->shmid, IPC_RMID, NULL);
+
+  if (shm_error)
+    {
+      fprintf(stderr, "MIT-SHM attach failed; using XPutImage\n");
+      shmdt(info->shmaddr);
+      shm_state = SHM_BROKEN;
+      goto fail;
+    }
+
+  up->ximage = ximage;
+  up->shm = info;
+  up->borrowed = 0;
+  return 1;
+
+ fail:
+  stats.shm_failures++;
+  if (ximage)
+    {
+      // XDestroyImage would free these.
+      ximage->data = NULL;
+      ximage->obdata = NULL;
+      XDestroyImage(ximage);
+    }
+  free(info);
+  return 0;
+}
+
+
+int upload_create_shm(struct upload *up, Display *dpy, int scr,
+		      int width, int height)
+{
+  return create_shm(up, dpy, scr, DefaultDepth(dpy, scr), width, height);
+}
+
+
+// An image of WIDTH x HEIGHT and DEPTH, in shared memory if possible.
+// Pixmaps of other depths than the screen's, such as the 32-bit ARGB
+// ones RENDER takes, go up this way too.
+void upload_create_depth(struct upload *up, Display *dpy, int scr,
+			 int depth, int width, int height)
+{
+  if (create_shm(up, dpy, scr, depth, width, height))
+    return;
+
+  up->ximage = XCreateImage(dpy, DefaultVisual(dpy, scr), depth, ZPixmap,
+			    0, NULL, width, height, 8, 0);
+  up->ximage->data = xmalloc((size_t) up->ximage->bytes_per_line * height);
+  up->shm = NULL;
+  up->borrowed = 0;
+}
+
+
+// An image of WIDTH x HEIGHT in the screen's format.
+void upload_create(struct upload *up, Display *dpy, int scr,
+		   int width, int height)
+{
+  upload_create_depth(up, dpy, scr, DefaultDepth(dpy, scr), width, height);
+}
+
+
+// Send an existing image, whose data stays with the caller.
+void upload_wrap(struct upload *up, XImage *ximage)
+{
+  up->ximage = ximage;
+  up->shm = NULL;
+  up->borrowed = 1;
+}
+
+
+// Copy the first ROWS rows of the image to row Y of DRAWABLE.  The
+// image can be refilled as soon as this returns.
+void upload_put(struct upload *up, Display *dpy, Drawable drawable, GC gc,
+		int y, int rows)
+{
+  unsigned long bytes = (unsigned long) up->ximage->bytes_per_line * rows;
+
+  if (up->shm)
+    {
+      XShmPutImage(dpy, drawable, gc, up->ximage, 0, 0, 0, y,
+		   up->ximage->width, rows, False);
+      // The server reads the segment when it gets to the request.
+      XSync(dpy, False);
+      stats.shm_puts++;
+      stats.shm_bytes += bytes;
+    }
+  else
+    {
+      XPutImage(dpy, drawable, gc, up->ximage, 0, 0, 0, y,
+		up->ximage->width, rows);
+      stats.plain_puts++;
+      stats.plain_bytes += bytes;
+    }
+}
+
+
+void upload_destroy(struct upload *up, Display *dpy)
+{
+  if (up->shm)
+    {
+      XShmSegmentInfo *info = up->shm;
+
+      XShmDetach(dpy, info);
+      shmdt(info->shmaddr);
+      free(info);
+      up->ximage->data = NULL;
+      up->ximage->obdata = NULL;
+    }
+  else if (up->borrowed)
+    up->ximage->data = NULL;
+
+  XDestroyImage(up->ximage);
+  up->ximage = NULL;
+  up->shm = NULL;
+}
+
+
+const struct upload_stats *upload_get_stats(void)
+{
+  return &stats;
+}
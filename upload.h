@@ -0,0 +1,32 @@
+#ifndef _UPLOAD_H_
+#define _UPLOAD_H_
+
+// An XImage on its way to the server, in a MIT-SHM segment when the
+// display is local and through the connection otherwise.
+struct upload
+{
+  XImage *ximage;
+  void *shm;			// XShmSegmentInfo, or NULL.
+  int borrowed;			// ximage->data belongs to the caller.
+};
+
+// How the pixels went, for the debug log.
+struct upload_stats
+{
+  int shm_puts, plain_puts, shm_failures;
+  unsigned long shm_bytes, plain_bytes;
+};
+
+int upload_create_shm(struct upload *up, Display *dpy, int scr,
+		      int width, int height);
+void upload_create_depth(struct upload *up, Display *dpy, int scr,
+			 int depth, int width, int height);
+void upload_create(struct upload *up, Display *dpy, int scr,
+		   int width, int height);
+void upload_wrap(struct upload *up, XImage *ximage);
+void upload_put(struct upload *up, Display *dpy, Drawable drawable, GC gc,
+		int y, int rows);
+void upload_destroy(struct upload *up, Display *dpy);
+const struct upload_stats *upload_get_stats(void);
+
+#endif /* _UPLOAD_H_ */
@@ -3,6 +3,10 @@
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "util.h"
 
 void out_of_memory()
@@ -109,3 +113,77 @@ char *mkfilepath(int elements, ...)
   *ptr = '\0';
   return path;
 }
+
+
+// Mapping saves the many small reads stdio would make, which hurt on
+// network block devices.  Anything unmappable is read in one go.  The
+// mapping is private and writable, so pixels kept where they lie can
+// be worked on in place; pages are only copied once written.
+int map_file(const char *filename, struct file_data *file)
+{
+  struct stat st;
+  void *map;
+  int fd;
+
+  memset(file, 0, sizeof(*file));
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st) || st.st_size <= 0)
+    {
+      close(fd);
+      return 0;
+    }
+  file->size = st.st_size;
+
+  map = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (map != MAP_FAILED)
+    {
+      posix_madvise(map, file->size, POSIX_MADV_SEQUENTIAL);
+      posix_madvise(map, file->size, POSIX_MADV_WILLNEED);
+      file->data = map;
+      file->mapped = 1;
+    }
+  else
+    {
+      unsigned char *buf = xmalloc(file->size);
+      size_t got = 0;
+
+      while (got < file->size)
+	{
+	  ssize_t n = read(fd, buf + got, file->size - got);
+	  if (n < 0 && errno == EINTR)
+	    continue;
+	  if (n <= 0)
+	    break;
+	  got += n;
+	}
+      file->data = buf;
+      file->size = got;
+    }
+
+  close(fd);
+  return file->size > 0;
+}
+
+
+void unmap_file(struct file_data *file)
+{
+  if (file->mapped)
+    munmap((void *) file->data, file->size);
+  else
+    free((void *) file->data);
+  memset(file, 0, sizeof(*file));
+}
+
+
+// Start the kernel reading FILENAME in the background, for when it will
+// be wanted shortly.
+void prefetch_file(const char *filename)
+{
+  int fd;
+
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+}
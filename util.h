@@ -13,4 +13,16 @@ char *xstrdup(const char *str);
 int break_tokens(char *str, char **tokens, int max_tokens);
 char *mkfilepath(int elements, ...);
 
+// A whole file in memory, mapped when the file system allows.
+struct file_data
+{
+  const unsigned char *data;
+  size_t size;
+  int mapped;
+};
+
+int map_file(const char *filename, struct file_data *file);
+void unmap_file(struct file_data *file);
+void prefetch_file(const char *filename);
+
 #endif /* _UTIL_H_ */